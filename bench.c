@@ -0,0 +1,127 @@
+#include <stdio.h>
+#include <time.h>
+
+#include "util.h"
+#include "btree.h"
+
+#include "test_data/numbers.h"
+
+/* Keeps the fetched entries from being optimized away */
+static volatile uint64_t sink;
+
+static uint64_t
+get_number(size_t i)
+{
+	return ((uint64_t) test_numbers[i >> 16] << 16) + test_numbers[i % ((size_t) 1 << 16)];
+}
+
+static double
+get_seconds(clock_t start)
+{
+	return (double) (clock() - start) / CLOCKS_PER_SEC;
+}
+
+static struct Btree *
+create_btree(size_t branch_size, size_t leaf_size, enum Btree_Key_Type key_type, enum Btree_Counts counts)
+{
+	return btree_new_config(&(struct Btree_Config) {
+		.branch_child_count_max = branch_size,
+		.leaf_entry_count_max = leaf_size,
+		.entry_size = sizeof(uint64_t),
+		.key_type = key_type,
+		.counts = counts,
+	});
+}
+
+/*
+ * Times insertions by key, insertions by index into a btree in sequence mode,
+ * and fetches by index, with branches keeping track of the entry counts of
+ * their children as `counts`
+ */
+static void
+run(size_t branch_size, size_t leaf_size, size_t count, enum Btree_Counts counts)
+{
+	struct Btree *btree = create_btree(branch_size, leaf_size, BTREE_KEY_U64, counts);
+	clock_t start = clock();
+	for (size_t i = 0; i < count; i++) {
+		uint64_t nr = get_number(i);
+		btree_insert(btree, &nr, NULL);
+	}
+	double insert_seconds = get_seconds(start);
+
+	struct Btree *sequence = create_btree(branch_size, leaf_size, BTREE_KEY_CUSTOM, counts);
+	start = clock();
+	for (size_t i = 0; i < count; i++) {
+		uint64_t nr = get_number(i);
+		btree_insert_at(sequence, nr % (i + 1), &nr);
+	}
+	double insert_at_seconds = get_seconds(start);
+
+	start = clock();
+	for (size_t i = 0; i < count; i++) {
+		size_t contiguous;
+		sink = *(const uint64_t *) btree_fetch(sequence, get_number(i) % count, &contiguous);
+	}
+	double fetch_seconds = get_seconds(start);
+
+	printf("%-10s %14.3f %14.3f %14.3f\n", counts == BTREE_COUNTS_CUMULATIVE ? "cumulative" : "per child", insert_seconds, insert_at_seconds, fetch_seconds);
+	btree_free(btree);
+	btree_free(sequence);
+}
+
+/*
+ * Returns the number of fetches by index per second from a btree in sequence
+ * mode with branches of `branch_size` children, bulk loaded with
+ * `count`-many entries
+ */
+static double
+get_fetch_rate(size_t branch_size, size_t leaf_size, size_t count, enum Btree_Counts counts)
+{
+	uint64_t *entries = xmalloc(count * sizeof(uint64_t));
+	for (size_t i = 0; i < count; i++)
+		entries[i] = get_number(i);
+	struct Btree *sequence = create_btree(branch_size, leaf_size, BTREE_KEY_CUSTOM, counts);
+	if (!btree_bulk_load(sequence, entries, count, 1))
+		die("Failed to bulk load the btree to fetch from");
+	free(entries);
+
+	clock_t start = clock();
+	for (size_t i = 0; i < count; i++) {
+		size_t contiguous;
+		sink = *(const uint64_t *) btree_fetch(sequence, get_number(i) % count, &contiguous);
+	}
+	double seconds = get_seconds(start);
+	btree_free(sequence);
+	return count / seconds;
+}
+
+int
+main(int argc, char **argv)
+{
+	if (argc != 4) {
+		fprintf(stderr, "Usage: bench branch_size leaf_size count\n");
+		return EXIT_FAILURE;
+	}
+
+	size_t branch_size = atol(argv[1]);
+	size_t leaf_size = atol(argv[2]);
+	size_t count = atol(argv[3]);
+	if (branch_size < 4 || leaf_size < 2 || !(0 < count && count <= (size_t) 65536 * 65536)) {
+		fprintf(stderr, "Invalid argv\n");
+		return EXIT_FAILURE;
+	}
+
+	printf("%-10s %14s %14s %14s\n", "counts", "insert (s)", "insert_at (s)", "fetch (s)");
+	run(branch_size, leaf_size, count, BTREE_COUNTS_CUMULATIVE);
+	run(branch_size, leaf_size, count, BTREE_COUNTS_PER_CHILD);
+
+	/* Finding children by index matters most in large branches */
+	static const size_t fanouts[] = { 64, 256, 1024 };
+	printf("\n%-10s %14s %14s\n", "fanout", "cumulative", "per child");
+	printf("%-10s %14s %14s\n", "", "(fetches/us)", "(fetches/us)");
+	for (size_t i = 0; i < sizeof(fanouts) / sizeof(fanouts[0]); i++) {
+		double cumulative = get_fetch_rate(fanouts[i], leaf_size, count, BTREE_COUNTS_CUMULATIVE);
+		double per_child = get_fetch_rate(fanouts[i], leaf_size, count, BTREE_COUNTS_PER_CHILD);
+		printf("%-10zu %14.3f %14.3f\n", fanouts[i], cumulative / 1e6, per_child / 1e6);
+	}
+}
@@ -1,13 +1,34 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <limits.h>
 #include <stdalign.h>
 #include <stddef.h>
 #include <stdbool.h>
 
 #include "btree.h"
+#include "pool.h"
+#include "search.h"
 #include "util.h"
 
+/* What nodes sized in bytes are aligned to */
+#define CACHE_LINE_BYTES 64
+#define PAGE_BYTES 4096
+/* The most bytes of a node that are prefetched */
+#define PREFETCH_BYTES_MAX 512
+/*
+ * The most branches on the path from the root to a leaf.  Every branch has at
+ * least two children and every leaf but an empty root holds an entry, so a
+ * taller btree would hold more entries than a size_t can count.
+ */
+#define PATH_LENGTH_MAX (sizeof(size_t) * CHAR_BIT)
+/* The size of the slot that branches store a string separator in by default */
+#define STRING_SEPARATOR_SIZE 64
+/* The largest slot, whose length byte can count all of its other bytes */
+#define STRING_SEPARATOR_SIZE_MAX 128
+/* Set in the length byte of a separator whose slot only holds its start */
+#define SEPARATOR_TRUNCATED 0x80
+
 struct Btree {
 	/* The maximum number of children of a non-leaf node. */
 	size_t branch_child_count_max;
@@ -15,13 +36,65 @@ struct Btree {
 	size_t leaf_entry_count_max;
 	/* The size of each leaf entry, in bytes */
 	size_t entry_size;
+	/*
+	 * The size of each key in a branch, in bytes, or 0 in sequence mode,
+	 * where branches are only searched by entry counts
+	 */
+	size_t key_size;
+	/* Where the key of an entry starts within it */
+	size_t key_offset;
+	/*
+	 * Whether keys are pointers to strings, which branches store as
+	 * separators encoded by `encode_separator` rather than copies
+	 */
+	bool string_keys;
+	/*
+	 * Whether leaves hold copies of string keys after their entries, in
+	 * which case `leaf_bytes` is the size of the area they share
+	 */
+	bool inline_keys;
+	size_t leaf_bytes;
+	/*
+	 * Room for the strings of two leaves with inline keys, which leaves
+	 * are rebuilt from when entries move between them, or NULL
+	 */
+	uint8_t *scratch;
 	/* The number of entries in the entire btree */
 	size_t entry_count;
 
+	/* NULL in sequence mode */
 	Btree_Compare *compare;
 	const void *compare_cb_data;
+	/*
+	 * The function normalizing custom keys, or NULL.  Leaves then hold
+	 * the normalized keys of their entries, and branches the normalized
+	 * key of each key after it, as the last 8 of its `key_size` bytes.
+	 */
+	Btree_Normalize *normalize;
+	/*
+	 * The functions that search leaves and branches for keys of a built-in
+	 * type without calling `compare`, or NULL for custom keys.  Keys are
+	 * spaced an entry apart in leaves, and a key apart in branches.
+	 */
+	Key_Search *key_search;
+	Key_Search *branch_key_search;
+	/* How insertions of entries matching entries in the btree are handled */
+	enum Btree_Duplicates duplicates;
+	/* How branches store the entry counts of their children */
+	enum Btree_Counts counts;
+	/* The function that finds a child by index in per-child counts */
+	Count_Scan *count_scan;
+	/* The number of bytes at the start of a node to prefetch, or 0 */
+	size_t prefetch_size;
 
 	struct Btree_Node *root;
+	/* The last leaf, which entries appended to the btree go to */
+	struct Btree_Node *last_leaf;
+	/*
+	 * The pool that nodes are allocated from, which is shared with
+	 * btrees split off from this one or concatenated with it
+	 */
+	struct Node_Pool *pool;
 };
 
 struct Btree_Node {
@@ -31,6 +104,13 @@ struct Btree_Node {
 	size_t child_count;
 	size_t entry_count;
 
+	/*
+	 * For leaf nodes, the neighboring leaves in order, or NULL at either
+	 * end of the btree.  Unused for branch nodes.
+	 */
+	struct Btree_Node *prev;
+	struct Btree_Node *next;
+
 	/* Data is inserted at the end of the structure.
 	 *
 	 * For leaf nodes, the data is structured like this:
@@ -40,21 +120,49 @@ struct Btree_Node {
 	 * with `btree->leaf_entry_count_max` total elements, each
 	 * `btree->entry_size` bytes in size.
 	 *
-	 * For branch nodes, the the first part of `data` is structured like
-	 * this:
+	 * For branch nodes, `data` is made up of three arrays:
+	 *
+	 *     [struct Btree_Node *][struct Btree_Node *]...[struct Btree_Node *]
+	 *     [size_t][size_t]...[size_t]
+	 *     [key][key]...[key]
+	 *
+	 * The first has `btree->branch_child_count_max`-many child node
+	 * pointers.  The second has `btree->branch_child_count_max - 1`-many
+	 * `size_t` values holding the number of entries of each of the
+	 * branch's children except the last, whose number follows from the
+	 * entry count of the branch.  They are either cumulative sums or
+	 * separate counts, depending on `btree->counts`.  The third has
+	 * `btree->branch_child_count_max - 1`-many keys, which are kept
+	 * contiguous so that searching a branch only touches the cache lines
+	 * holding keys.  Each key is a copy of the key of an entry
+	 * (`btree->key_size` bytes, which is 0 in sequence mode).
+	 *
+	 * Leaves of a btree with a `normalize` function hold an array of
+	 * the normalized keys of their entries after the entries:
+	 *
+	 *     [entry][entry]...[entry][uint64_t][uint64_t]...[uint64_t]
 	 *
-	 *     [struct Btree_Node *][key][struct Btree_Node *][key]...[struct Btree_Node *]
+	 * Leaves of a btree with inline keys hold `btree->leaf_bytes` bytes
+	 * of entries and strings, followed by a `struct Leaf_Heap`:
 	 *
-	 * with `btree->branch_child_count_max`-many child node pointers, and
-	 * `btree->branch_child_count_max - 1`-many keys.  Each key is just a
-	 * copy of an entry and is thus the same size as an entry
-	 * (`btree->entry_size` bytes).  The second part of data is an array of
-	 * `size_t` values representing the cumulative sums of the number of
-	 * entries of the branch's children.
+	 *     [entry][entry]...        ...[string][string][string]
+	 *
+	 * Entries grow from the start and strings from the end, and the
+	 * leaf is full when they would meet.
 	 */
 	alignas(max_align_t) uint8_t data[];
 };
 
+/*
+ * Where the strings of a leaf with inline keys start, and how many bytes of
+ * them belong to its entries.  Strings of entries that were removed or moved
+ * to another leaf are left behind until the leaf is repacked.
+ */
+struct Leaf_Heap {
+	size_t start;
+	size_t used;
+};
+
 /*
  * Returns a pointer to an entry of a leaf node
  */
@@ -70,30 +178,31 @@ get_leaf_entry_ptr(const struct Btree *restrict btree, const struct Btree_Node *
 static inline struct Btree_Node **
 get_branch_child_ptr_ptr(const struct Btree *restrict btree, const struct Btree_Node *restrict branch, size_t child_index)
 {
-	return (struct Btree_Node **) (branch->data + child_index * (sizeof(struct Btree_Node *) + btree->entry_size));
+	(void) btree;
+	return (struct Btree_Node **) branch->data + child_index;
 }
 
 /*
- * Returns a pointer to a key in a branch node
+ * Returns a pointer to the array of the entry counts of the branch's children
  */
-static inline void *
-get_branch_key_ptr(const struct Btree *restrict btree, const struct Btree_Node *restrict branch, size_t key_index)
+static inline size_t *
+get_branch_counts(const struct Btree *restrict btree, const struct Btree_Node *restrict branch)
 {
-	return (void *) (branch->data + key_index * sizeof(struct Btree_Node *) + (key_index - 1) * btree->entry_size);
+	return (size_t *) (branch->data + btree->branch_child_count_max * sizeof(struct Btree_Node *));
 }
 
 /*
- * Returns a pointer to an array of the cumulative sum of the sizes of each of
- * the branch's children
+ * Returns a pointer to a key in a branch node.  The key at `key_index` goes in
+ * front of the child at the same index, so the first child has no key.
  */
-static inline size_t *
-get_branch_cumulative_sizes(const struct Btree *restrict btree, const struct Btree_Node *restrict branch)
+static inline void *
+get_branch_key_ptr(const struct Btree *restrict btree, const struct Btree_Node *restrict branch, size_t key_index)
 {
-	return (size_t *) (branch->data + btree->branch_child_count_max * sizeof(struct Btree_Node *) + (btree->branch_child_count_max - 1) * btree->entry_size);
+	return (void *) ((uint8_t *) (get_branch_counts(btree, branch) + btree->branch_child_count_max - 1) + (key_index - 1) * btree->key_size);
 }
 
 /*
- * Compares the two specified entries and returns the result of the `btree->compare` callback.
+ * Compares the two specified keys and returns the result of the `btree->compare` callback.
  */
 static inline int
 compare(const struct Btree *btree, const void *a, const void *b)
@@ -102,406 +211,3329 @@ compare(const struct Btree *btree, const void *a, const void *b)
 }
 
 /*
- * Creates a new leaf node
+ * Returns a pointer to the key of an entry
  */
-static struct Btree_Node *
-create_leaf(const struct Btree *restrict btree, size_t entry_count)
+static inline const void *
+get_entry_key(const struct Btree *btree, const void *entry)
 {
-	struct Btree_Node *leaf = xmalloc(
-		/* Base struct */
-		sizeof(struct Btree_Node) +
-		/* Array of entries */
-		btree->leaf_entry_count_max * btree->entry_size
-	);
-	leaf->child_count = 0;
-	leaf->entry_count = entry_count;
-	return leaf;
+	return (const uint8_t *) entry + btree->key_offset;
 }
 
 /*
- * Creates a new branch node
+ * Compares the keys of two entries
  */
-static struct Btree_Node *
-create_branch(const struct Btree *restrict btree, size_t child_count, size_t entry_count)
+static inline int
+compare_entries(const struct Btree *btree, const void *a, const void *b)
 {
-	struct Btree_Node *branch = xmalloc(
-		/* Base struct */
-		sizeof(struct Btree_Node) +
-		/* Keys and child pointers, intermixed */
-		btree->branch_child_count_max * sizeof(struct Btree_Node *) + (btree->branch_child_count_max - 1) * btree->entry_size +
-		/* Array containing the cumulative entry counts of each child of the branch (excluding the last one) */
-		(btree->branch_child_count_max - 1) * sizeof(size_t)
-	);
-	branch->child_count = child_count;
-	branch->entry_count = entry_count;
-	return branch;
+	return compare(btree, get_entry_key(btree, a), get_entry_key(btree, b));
 }
 
 /*
- * Creates a new btree.  `branch_child_count_max` must be at least 4.
- * `leaf_entry_count_max` must be at least 2.  In practice, both of these
- * values will be significantly larger than those minima, and
- * `leaf_entry_count_max` should probably be greater than
- * `branch_child_count_max` for best performance.
+ * Returns the normalized key of a key, or 0 if the btree has no `normalize`
+ * function
  */
-struct Btree *
-btree_new(size_t branch_child_count_max, size_t leaf_entry_count_max, size_t entry_size, Btree_Compare *compare, const void *compare_cb_data)
+static inline uint64_t
+normalize_key(const struct Btree *btree, const void *key)
 {
-	struct Btree *btree = xmalloc(sizeof(struct Btree));
-	btree->leaf_entry_count_max = leaf_entry_count_max;
-	btree->branch_child_count_max = branch_child_count_max;
-	btree->entry_size = entry_size;
-	btree->entry_count = 0;
-	btree->compare = compare;
-	btree->compare_cb_data = compare_cb_data;
-	btree->root = create_leaf(btree, 0);
-	return btree;
+	return btree->normalize != NULL ? btree->normalize(key, btree->compare_cb_data) : 0;
 }
 
 /*
- * Frees a node and all of its children (if it has any)
+ * Returns where the normalized keys of the entries of a leaf start within its
+ * data, which is the first 8-byte boundary after its entries
  */
-static void
-free_node(struct Btree *restrict btree, struct Btree_Node *restrict node)
+static inline size_t
+get_normalized_keys_offset(const struct Btree *btree)
 {
-	for (size_t i = 0; i < node->child_count; i++)
-		free_node(btree, *get_branch_child_ptr_ptr(btree, node, i));
-	free(node);
+	size_t offset = btree->leaf_entry_count_max * btree->entry_size;
+	return (offset + alignof(uint64_t) - 1) / alignof(uint64_t) * alignof(uint64_t);
 }
 
 /*
- * Frees a btree
+ * Returns the array of the normalized keys of the entries of a leaf
  */
-void
-btree_free(struct Btree *btree)
+static inline uint64_t *
+get_leaf_normalized_keys(const struct Btree *restrict btree, const struct Btree_Node *restrict leaf)
 {
-	free_node(btree, btree->root);
-	free(btree);
+	return (uint64_t *) (leaf->data + get_normalized_keys_offset(btree));
 }
 
 /*
- * Conducts a binary search on a btree leaf.  Returns true if an exact match
- * was found, or false otherwise.  If no exact match was found, the index is
- * set to the index of the first entry greater than the target.  Otherwise,
- * `index` is set to the index of the matched entry.
+ * Normalizes the keys of `count` entries of a leaf, starting at `index`
  */
-static bool
-leaf_search(const struct Btree *restrict btree, const struct Btree_Node *restrict leaf, const void *restrict target_entry, size_t *restrict index)
+static void
+normalize_entries(const struct Btree *restrict btree, struct Btree_Node *restrict leaf, size_t index, size_t count)
 {
-	size_t low = 0;
-	size_t high = leaf->entry_count;
-	while (low != high) {
-		size_t middle = (low + high) / 2;
-		void *middle_entry = get_leaf_entry_ptr(btree, leaf, middle);
-		int comparison = compare(btree, middle_entry, target_entry);
-		if (comparison == 0) {
-			*index = middle;
-			return true;
-		}
-		if (comparison < 0)
-			high = middle;
-		else
-			low = middle + 1;
-	}
-	*index = low;
-	return false;
+	uint64_t *normalized = get_leaf_normalized_keys(btree, leaf);
+	for (size_t i = index; i < index + count; i++)
+		normalized[i] = normalize_key(btree, get_entry_key(btree, get_leaf_entry_ptr(btree, leaf, i)));
 }
 
 /*
- * Conducts a binary search on a btree branch.  If a key in the branch is an
- * exact match, the function returns a pointer to that key.  Otherwise, NULL
- * is returned, and `index` is set to the index of the first entry that
- * comes after the target.
+ * Compares a key with the normalized key `normalized` to a target key with the
+ * normalized key `target_normalized`, calling `btree->compare` only if the
+ * normalized keys are equal
  */
-static void *
-branch_search(const struct Btree *restrict btree, const struct Btree_Node *restrict branch, const void *restrict target_entry, size_t *restrict index)
+static inline int
+compare_normalized(const struct Btree *restrict btree, const void *restrict key, uint64_t normalized, const void *restrict target_key, uint64_t target_normalized)
 {
-	size_t low = 0;
-	size_t high = branch->child_count - 1;
-	while (low != high) {
-		size_t middle = (low + high + 1) / 2;
-		void *middle_key = get_branch_key_ptr(btree, branch, middle);
-		int comparison = compare(btree, middle_key, target_entry);
-		if (comparison == 0)
-			return middle_key;
-		if (comparison < 0)
-			high = middle - 1;
-		else
-			low = middle;
-	}
-	*index = low;
-	return NULL;
+	if (normalized != target_normalized)
+		return normalized < target_normalized ? 1 : -1;
+	return compare(btree, key, target_key);
 }
 
 /*
- * Inserts an entry into a leaf, determining the index by conducting a binary
- * search.  The leaf MUST NOT be full when calling this function.
+ * Returns the string that is the key of an entry of a btree with string keys
  */
-static void
-leaf_insert(const struct Btree *restrict btree, struct Btree_Node *restrict leaf, const void *restrict entry)
+static inline const char *
+get_entry_string(const struct Btree *btree, const void *entry)
 {
-	size_t insertion_index;
-	if (leaf_search(btree, leaf, entry, &insertion_index))
-		die("Found an exact match in a leaf.  That's not supposed to happen since insertions should never be duplicates.");
-	memmove(get_leaf_entry_ptr(btree, leaf, insertion_index + 1), get_leaf_entry_ptr(btree, leaf, insertion_index), btree->entry_size * (leaf->entry_count - insertion_index));
-	memcpy(get_leaf_entry_ptr(btree, leaf, insertion_index), entry, btree->entry_size);
-	leaf->entry_count++;
+	const char *string;
+	memcpy(&string, get_entry_key(btree, entry), sizeof(const char *));
+	return string;
 }
 
 /*
- * Inserts a child into a branch at the specified index.  The branch MUST
- * NOT be full when calling this function.  `child_index` MUST BE GREATER THAN
- * ZERO.
+ * Points the key of an entry of a btree with string keys to `string`
  */
-static void
-branch_insert(const struct Btree *restrict btree, struct Btree_Node *restrict branch, const void *restrict key, size_t child_index, struct Btree_Node *restrict child)
+static inline void
+set_entry_string(const struct Btree *btree, void *entry, const char *string)
 {
-	memmove(get_branch_key_ptr(btree, branch, child_index + 1), get_branch_key_ptr(btree, branch, child_index), (branch->child_count - child_index) * (sizeof(struct Btree_Node *) + btree->entry_size));
-	memcpy(get_branch_key_ptr(btree, branch, child_index), key, btree->entry_size);
-	*get_branch_child_ptr_ptr(btree, branch, child_index) = child;
-	branch->child_count++;
-
-	/* Update cumulative sizes array */
-	size_t *cumulative_sizes = get_branch_cumulative_sizes(btree, branch);
-	for (size_t i = branch->child_count - 2; i > child_index; i--)
-		cumulative_sizes[i] = cumulative_sizes[i - 1] + 1;
-	if (child_index < btree->branch_child_count_max - 1)
-		cumulative_sizes[child_index] = cumulative_sizes[child_index - 1] + child->entry_count;
+	memcpy((uint8_t *) entry + btree->key_offset, &string, sizeof(const char *));
 }
 
 /*
- * Gets a pointer to the first entry in a node
+ * Returns the heap of a leaf with inline keys
  */
-static void *
-get_first_entry_ptr(const struct Btree *restrict btree, const struct Btree_Node *restrict node)
+static inline struct Leaf_Heap *
+get_leaf_heap(const struct Btree *restrict btree, const struct Btree_Node *restrict leaf)
 {
-	while (node->child_count != 0)
-		node = *get_branch_child_ptr_ptr(btree, node, 0);
-	return get_leaf_entry_ptr(btree, node, 0);
+	return (struct Leaf_Heap *) (leaf->data + btree->leaf_bytes);
 }
 
 /*
- * Updates the value of the cumulative size array at a specified index.
- * `entry_count` should refer to the number of entries of the child at
- * the specified index.  The value in the cumulative size array is set
- * to `entry_count`, plus the value of the preceding element, unless
- * `index` is 0.
+ * Returns how much of a leaf an entry takes up: its bytes and those of its
+ * string with inline keys, or otherwise a single slot
  */
-static void
-update_branch_cumulative_size_at_index(const struct Btree *restrict btree, const struct Btree_Node *restrict branch, size_t index, size_t entry_count)
+static size_t
+get_entry_load(const struct Btree *btree, const void *entry)
 {
-	size_t *cumulative_sizes = get_branch_cumulative_sizes(btree, branch);
-	cumulative_sizes[index] = entry_count;
-	if (index > 0)
-		cumulative_sizes[index] += cumulative_sizes[index - 1];
+	if (!btree->inline_keys)
+		return 1;
+	return btree->entry_size + strlen(get_entry_string(btree, entry)) + 1;
 }
 
 /*
- * Inserts an entry into a btree node.  If the node is a branch, then this
- * function will recurse on itself to find a leaf.  If the specified node
- * is full, then this function will split the node into two, and the newly
- * created node, which contains the upper half of the original node, will
- * be returned.  In that case, `*key` will be set to a pointer to the entry
- * that should be used as the key placed between the old node and the new node
- * in the branch containing them.  If no new node is created, then NULL is
- * returned.
+ * Returns how much of a leaf its entries take up, in the units of
+ * `get_entry_load`
  */
-static struct Btree_Node *
-node_insert(const struct Btree *restrict btree, struct Btree_Node *restrict node, const void *restrict entry, const void *restrict *restrict key)
+static size_t
+get_leaf_load(const struct Btree *restrict btree, const struct Btree_Node *restrict leaf)
 {
-	if (node->child_count == 0) {
-		/* If the leaf is full, split it in half */
-		if (node->entry_count == btree->leaf_entry_count_max) {
-			node->entry_count = btree->leaf_entry_count_max / 2;
-			size_t middle_index = node->entry_count;
-			void *middle_entry = get_leaf_entry_ptr(btree, node, middle_index);
-
-			struct Btree_Node *new_leaf = create_leaf(btree, btree->leaf_entry_count_max - middle_index);
-			void *leaf_entries_start = get_leaf_entry_ptr(btree, new_leaf, 0);
-			memcpy(leaf_entries_start, middle_entry, new_leaf->entry_count * btree->entry_size);
+	if (!btree->inline_keys)
+		return leaf->entry_count;
+	return leaf->entry_count * btree->entry_size + get_leaf_heap(btree, leaf)->used;
+}
 
-			/* Now insert the new entry */
-			struct Btree_Node *insertion_target = compare(btree, middle_entry, entry) < 0 ? node : new_leaf;
-			leaf_insert(btree, insertion_target, entry);
+/*
+ * Returns the load that a leaf can hold
+ */
+static size_t
+get_leaf_capacity(const struct Btree *btree)
+{
+	return btree->inline_keys ? btree->leaf_bytes : btree->leaf_entry_count_max;
+}
 
-			*key = leaf_entries_start;
-			return new_leaf;
-		}
+/*
+ * Returns the largest load of a single entry.  Halving a leaf by load then
+ * leaves room in either half for any entry.
+ */
+static size_t
+get_entry_load_max(const struct Btree *btree)
+{
+	return btree->inline_keys ? btree->leaf_bytes / 4 : 1;
+}
 
-		leaf_insert(btree, node, entry);
-		return NULL;
+/*
+ * Copies the strings of the entries of a leaf with inline keys, wherever they
+ * are, one after another to `dst`, and points the entries to the copies.
+ * Returns the number of bytes copied.
+ */
+static size_t
+pack_strings(const struct Btree *restrict btree, struct Btree_Node *restrict leaf, uint8_t *restrict dst)
+{
+	size_t size = 0;
+	for (size_t i = 0; i < leaf->entry_count; i++) {
+		void *entry = get_leaf_entry_ptr(btree, leaf, i);
+		const char *string = get_entry_string(btree, entry);
+		size_t length = strlen(string) + 1;
+		memcpy(dst + size, string, length);
+		set_entry_string(btree, entry, (const char *) dst + size);
+		size += length;
 	}
+	return size;
+}
 
-	size_t child_index;
-	void *found_key = branch_search(btree, node, entry, &child_index);
-	if (found_key != NULL)
-		die("Found an exact match in a branch.  That's not supposed to happen since insertions should never be duplicates.");
-
-	struct Btree_Node **child_ptr_ptr = get_branch_child_ptr_ptr(btree, node, child_index);
-	struct Btree_Node *new_child = node_insert(btree, *child_ptr_ptr, entry, key);
-	if (new_child != NULL) {
-		/*
-		 * The child node that this node passed on the insertion to had
-		 * to be split, so now a new node needs to be added to this
-		 * node.
-		 */
-
-		size_t new_child_index = child_index + 1;
-
-		if (node->child_count == btree->branch_child_count_max) {
-			/* This branch is full, so it must be split */
-
-			size_t middle_index = btree->branch_child_count_max / 2;
-			struct Btree_Node **middle_child_ptr_ptr = get_branch_child_ptr_ptr(btree, node, middle_index);
-			node->child_count = middle_index;
+/*
+ * Moves the strings of a leaf with inline keys out to `scratch`, which must
+ * have room for all of them, leaving the leaf's heap empty.  Entries can
+ * then be moved in and out of the leaf freely until `adopt_strings`.
+ */
+static void
+evacuate_strings(const struct Btree *restrict btree, struct Btree_Node *restrict leaf, uint8_t *restrict scratch)
+{
+	pack_strings(btree, leaf, scratch);
+	struct Leaf_Heap *heap = get_leaf_heap(btree, leaf);
+	heap->start = btree->leaf_bytes;
+	heap->used = 0;
+}
 
-			/*
-			 * Create a new branch and copy its child pointers and
-			 * keys from the other branch (`node`)
-			 */
-			struct Btree_Node *new_branch = create_branch(btree, btree->branch_child_count_max - middle_index, 0);
-			struct Btree_Node **new_branch_first_child_ptr_ptr = get_branch_child_ptr_ptr(btree, new_branch, 0);
-			memcpy(new_branch_first_child_ptr_ptr, middle_child_ptr_ptr, new_branch->child_count * sizeof(struct Btree_Node *) + (new_branch->child_count - 1) * btree->entry_size);
+/*
+ * Copies the strings of the entries of a leaf with inline keys, which must be
+ * outside of the leaf, into its empty heap
+ */
+static void
+adopt_strings(const struct Btree *restrict btree, struct Btree_Node *restrict leaf)
+{
+	struct Leaf_Heap *heap = get_leaf_heap(btree, leaf);
+	for (size_t i = 0; i < leaf->entry_count; i++) {
+		void *entry = get_leaf_entry_ptr(btree, leaf, i);
+		const char *string = get_entry_string(btree, entry);
+		size_t length = strlen(string) + 1;
+		heap->start -= length;
+		heap->used += length;
+		memcpy(leaf->data + heap->start, string, length);
+		set_entry_string(btree, entry, (const char *) leaf->data + heap->start);
+	}
+}
 
-			/* Update entry counts */
-			size_t tmp = node->entry_count;
-			node->entry_count = get_branch_cumulative_sizes(btree, node)[middle_index - 1];
-			new_branch->entry_count = tmp - node->entry_count;
+/*
+ * Returns the size of the scratch space of a btree
+ */
+static size_t
+get_scratch_size(const struct Btree *btree)
+{
+	return btree->inline_keys ? 2 * btree->leaf_bytes : 0;
+}
 
-			/* Set cumulative entry count array for the new branch */
-			for (size_t i = 0; i < new_branch->child_count - 1; i++)
-				get_branch_cumulative_sizes(btree, new_branch)[i] = get_branch_cumulative_sizes(btree, node)[middle_index + i] - node->entry_count;
+/*
+ * Drops the strings left behind in a leaf with inline keys, so that its free
+ * space is in one piece
+ */
+static void
+repack_strings(const struct Btree *restrict btree, struct Btree_Node *restrict leaf)
+{
+	evacuate_strings(btree, leaf, btree->scratch);
+	adopt_strings(btree, leaf);
+}
 
-			/*
-			 * Determine which of the two branches `new_child`
-			 * should be inserted into.
-			 */
-			struct Btree_Node *target_branch;
-			if (child_index < middle_index) {
-				target_branch = node;
-			} else {
-				target_branch = new_branch;
-				child_index -= middle_index;
-				new_child_index -= middle_index;
-			}
+/*
+ * Stores the shortest string that comes after `left` and does not come after
+ * `right` in a separator slot of `slot_size` bytes: a length byte followed by
+ * the string's bytes without a terminator.  That is `right` cut off one byte
+ * past where it differs from `left`.  If it doesn't fit, the slot holds as
+ * much of it as fits and is marked as truncated.
+ */
+static void
+encode_separator(uint8_t *restrict slot, size_t slot_size, const char *restrict left, const char *restrict right)
+{
+	size_t length = 0;
+	while (left[length] == right[length] && right[length] != '\0')
+		length++;
+	/* Equal strings, which btrees allowing duplicates have, are kept whole */
+	if (right[length] != '\0')
+		length++;
+	uint8_t flags = 0;
+	if (length > slot_size - 1) {
+		length = slot_size - 1;
+		flags = SEPARATOR_TRUNCATED;
+	}
+	slot[0] = (uint8_t) length | flags;
+	memcpy(slot + 1, right, length);
+}
 
-			/* Update the cumulative entry count at `child_index` */
-			update_branch_cumulative_size_at_index(btree, target_branch, child_index, (*child_ptr_ptr)->entry_count);
+/*
+ * Compares a separator slot with a string, following the convention of
+ * `Btree_Compare`.  If the slot is truncated and the string starts with all of
+ * its bytes, the order is unknown, and `*undecided` is set to true.
+ */
+static int
+compare_separator(const uint8_t *restrict slot, const char *restrict string, bool *restrict undecided)
+{
+	size_t length = slot[0] & ~SEPARATOR_TRUNCATED;
+	/* A string that ends first comes first, since separators have no NULs */
+	int comparison = strncmp(string, (const char *) slot + 1, length);
+	if (comparison != 0)
+		return (comparison > 0) - (comparison < 0);
+	if (slot[0] & SEPARATOR_TRUNCATED) {
+		*undecided = true;
+		return 0;
+	}
+	return string[length] != '\0';
+}
 
-			/*
-			 * Insert the new child.  This will also update the
-			 * rest of the cumulative size array.
-			 */
-			branch_insert(btree, target_branch, *key, new_child_index, new_child);
+/*
+ * Starts loading the first cache lines of a node, up to all of them for small
+ * nodes, if the btree prefetches.  Whether the node is a leaf or a branch
+ * isn't known until it's loaded, so the size is the larger of the two.
+ */
+static inline void
+prefetch_node(const struct Btree *restrict btree, const struct Btree_Node *restrict node)
+{
+#ifdef __GNUC__
+	for (size_t offset = 0; offset < btree->prefetch_size; offset += CACHE_LINE_BYTES)
+		__builtin_prefetch((const uint8_t *) node + offset);
+#else
+	(void) btree;
+	(void) node;
+#endif
+}
 
-			/*
-			 * We haven't incremented the entry count from
-			 * the insertion yet, so do it now
-			 */
-			target_branch->entry_count++;
+/*
+ * Returns the child of a branch at `child_index`, which a descent is about to
+ * visit, after starting to prefetch it
+ */
+static inline struct Btree_Node *
+get_child(const struct Btree *restrict btree, const struct Btree_Node *restrict branch, size_t child_index)
+{
+	struct Btree_Node *child = *get_branch_child_ptr_ptr(btree, branch, child_index);
+	prefetch_node(btree, child);
+	return child;
+}
 
-			*key = get_first_entry_ptr(btree, new_branch);
-			return new_branch;
-		}
+/*
+ * The branches on the path from the root of a btree down to a leaf, along with
+ * the index of the child followed at each of them
+ */
+struct Path {
+	size_t length;
+	struct Btree_Node *branches[PATH_LENGTH_MAX];
+	size_t child_indices[PATH_LENGTH_MAX];
+};
 
-		/* Update the cumulative entry count at `child_index` */
-		update_branch_cumulative_size_at_index(btree, node, child_index, (*child_ptr_ptr)->entry_count);
+/*
+ * Adds a branch and the index of the child followed at it to the end of a path
+ */
+static inline void
+path_push(struct Path *restrict path, struct Btree_Node *restrict branch, size_t child_index)
+{
+	if (path->length == PATH_LENGTH_MAX)
+		die("Attempted to descend a btree deeper than it can be.");
+	path->branches[path->length] = branch;
+	path->child_indices[path->length] = child_index;
+	path->length++;
+}
 
-		/*
-		 * Insert the new child.  This will also update the rest of the
-		 * cumulative size array.
-		 */
-		branch_insert(btree, node, *key, new_child_index, new_child);
-	} else {
-		/* Update the cumulative sizes array */
-		for (size_t i = child_index; i < node->child_count - 1; i++) {
-			get_branch_cumulative_sizes(btree, node)[i]++;
-		}
-	}
-	node->entry_count++;
-	return NULL;
+/*
+ * Returns the size of a leaf node of a btree, in bytes
+ */
+static size_t
+get_leaf_size(const struct Btree *btree)
+{
+	if (btree->inline_keys)
+		return sizeof(struct Btree_Node) + btree->leaf_bytes + sizeof(struct Leaf_Heap);
+	if (btree->normalize != NULL)
+		return sizeof(struct Btree_Node) + get_normalized_keys_offset(btree) + btree->leaf_entry_count_max * sizeof(uint64_t);
+	return
+		/* Base struct */
+		sizeof(struct Btree_Node) +
+		/* Array of entries */
+		btree->leaf_entry_count_max * btree->entry_size;
 }
 
 /*
- * Inserts an entry into a btree
+ * Returns the size of a branch node of a btree, in bytes
  */
-void
-btree_insert(struct Btree *restrict btree, const void *restrict entry)
+static size_t
+get_branch_size(const struct Btree *btree)
 {
-	const void *key;
-	struct Btree_Node *new_node = node_insert(btree, btree->root, entry, &key);
-	if (new_node != NULL) {
-		/*
-		 * The root was full and had to be split.  Construct a new root
-		 * that contains the original root and the new node.
-		 */
-		struct Btree_Node *old_root = btree->root;
-		btree->root = create_branch(btree, 2, old_root->entry_count + new_node->entry_count);
-		*get_branch_child_ptr_ptr(btree, btree->root, 0) = old_root;
-		memcpy(get_branch_key_ptr(btree, btree->root, 1), key, btree->entry_size);
-		*get_branch_child_ptr_ptr(btree, btree->root, 1) = new_node;
-		get_branch_cumulative_sizes(btree, btree->root)[0] = old_root->entry_count;
-	}
-	btree->entry_count++;
+	return
+		/* Base struct */
+		sizeof(struct Btree_Node) +
+		/* Array of child pointers */
+		btree->branch_child_count_max * sizeof(struct Btree_Node *) +
+		/* Array containing the entry counts of each child of the branch (excluding the last one) */
+		(btree->branch_child_count_max - 1) * sizeof(size_t) +
+		/* Array of keys */
+		(btree->branch_child_count_max - 1) * btree->key_size;
 }
 
 /*
- * Returns a pointer to the entry at a given index (`entry_index`) within a
- * subtree.  `*count` is set to the number of entries that can be read from the
- * returned pointer (as an array) and will be at least 1.
+ * Returns the number of entries that fit in a leaf of `node_size` bytes.  With
+ * inline keys, each entry also takes at least the terminator of its string,
+ * and with a `normalize` function, its normalized key.
  */
-static const void *
-node_fetch(const struct Btree *restrict btree, const struct Btree_Node *restrict node, size_t entry_index, size_t *restrict count)
+static size_t
+get_leaf_entry_count_max(const struct Btree *btree, size_t node_size)
 {
-	if (node->child_count == 0) {
-		*count = node->entry_count - entry_index;
-		return get_leaf_entry_ptr(btree, node, entry_index);
+	size_t overhead = sizeof(struct Btree_Node) + (btree->inline_keys ? sizeof(struct Leaf_Heap) : 0);
+	size_t per_entry = btree->entry_size + (btree->inline_keys ? 1 : 0);
+	/* Normalized keys take 8 bytes each, after up to 7 bytes of padding */
+	if (btree->normalize != NULL) {
+		overhead += alignof(uint64_t) - 1;
+		per_entry += sizeof(uint64_t);
 	}
+	size_t count = node_size > overhead ? (node_size - overhead) / per_entry : 0;
+	if (count < 2)
+		die("Attempted to create a btree with leaves too small for two entries.");
+	return count;
+}
 
-	size_t *cumulative_sizes = get_branch_cumulative_sizes(btree, node);
-	size_t low_index = 0;
-	size_t high_index = node->child_count;
-	while (low_index != high_index) {
-		size_t middle_index = (low_index + high_index) / 2;
+/*
+ * Returns the number of children that fit in a branch of `node_size` bytes.
+ * Each child takes a pointer, and all but the last also take an entry count
+ * and a key.
+ */
+static size_t
+get_branch_child_count_max(const struct Btree *btree, size_t node_size)
+{
+	size_t per_child = sizeof(struct Btree_Node *) + sizeof(size_t) + btree->key_size;
+	size_t available = node_size + sizeof(size_t) + btree->key_size;
+	size_t count = available > sizeof(struct Btree_Node) ? (available - sizeof(struct Btree_Node)) / per_child : 0;
+	if (count < 4)
+		die("Attempted to create a btree with branches too small for four children.");
+	return count;
+}
 
-		size_t middle_size;
-		if (middle_index == node->child_count - 1) {
-			if (low_index == middle_index)
-				return node_fetch(btree, *get_branch_child_ptr_ptr(btree, node, middle_index), entry_index - cumulative_sizes[node->child_count - 2], count);
-			middle_size = node->entry_count;
-		} else {
-			middle_size = cumulative_sizes[middle_index];
-		}
+/*
+ * Returns the alignment of a node of `node_size` bytes, which is a page if it
+ * spans whole pages, and a cache line otherwise
+ */
+static size_t
+get_node_alignment(size_t node_size)
+{
+	return node_size >= PAGE_BYTES ? PAGE_BYTES : CACHE_LINE_BYTES;
+}
 
-		if (middle_size > entry_index) {
-			high_index = middle_index;
-		} else if (middle_size == entry_index) {
-			const struct Btree_Node *child = *get_branch_child_ptr_ptr(btree, node, middle_index + 1);
-			while (child->child_count > 0)
-				child = *get_branch_child_ptr_ptr(btree, child, 0);
-			*count = child->entry_count;
-			return get_leaf_entry_ptr(btree, child, 0);
-		} else {
-			low_index = middle_index + 1;
-		}
+/*
+ * Creates a new leaf node.  Operations that can fail reserve their nodes
+ * beforehand, so running out of memory here is fatal.
+ */
+static struct Btree_Node *
+create_leaf(const struct Btree *restrict btree, size_t entry_count)
+{
+	struct Btree_Node *leaf = pool_alloc(btree->pool, POOL_LEAF);
+	if (leaf == NULL)
+		die("Failed to allocate a leaf that wasn't reserved.");
+	leaf->child_count = 0;
+	leaf->entry_count = entry_count;
+	leaf->prev = NULL;
+	leaf->next = NULL;
+	if (btree->inline_keys) {
+		get_leaf_heap(btree, leaf)->start = btree->leaf_bytes;
+		get_leaf_heap(btree, leaf)->used = 0;
 	}
+	return leaf;
+}
 
-	size_t child_index = low_index;
-	if (child_index > 0)
-		entry_index -= cumulative_sizes[child_index - 1];
-	return node_fetch(btree, *get_branch_child_ptr_ptr(btree, node, child_index), entry_index, count);
+/*
+ * Creates a new branch node.  As with `create_leaf`, running out of memory is
+ * fatal.
+ */
+static struct Btree_Node *
+create_branch(const struct Btree *restrict btree, size_t child_count, size_t entry_count)
+{
+	struct Btree_Node *branch = pool_alloc(btree->pool, POOL_BRANCH);
+	if (branch == NULL)
+		die("Failed to allocate a branch that wasn't reserved.");
+	branch->child_count = child_count;
+	branch->entry_count = entry_count;
+	return branch;
 }
 
 /*
- * Retrieves an entry at a specific index.  Returns a pointer to the requested
- * entry.  `*count` is set to the number of entries that can be read from the
- * returned pointer, including the requested entry, as an array, and will be at
- * least 1.  Make sure the function is called with a valid index.
+ * Makes sure that `leaf_count`-many leaves and `branch_count`-many branches
+ * can be created without running out of memory, so that an operation that
+ * can't be completed fails before it modifies the btree.  Returns false if
+ * the memory for them can't be allocated.
  */
-const void *
-btree_fetch(const struct Btree *restrict btree, size_t entry_index, size_t *restrict count)
+static bool
+reserve_nodes(const struct Btree *btree, size_t leaf_count, size_t branch_count)
 {
-	return node_fetch(btree, btree->root, entry_index, count);
+	return pool_reserve(btree->pool, POOL_LEAF, leaf_count) && pool_reserve(btree->pool, POOL_BRANCH, branch_count);
+}
+
+/*
+ * Allocates `size` bytes for an operation to work in with the allocator of a
+ * btree, so that running out of memory fails the operation instead of exiting.
+ * Returns NULL if they can't be allocated.
+ */
+static void *
+alloc_buffer(const struct Btree *btree, size_t size)
+{
+	return pool_alloc_object(btree->pool, size > 0 ? size : 1);
+}
+
+/*
+ * Frees `size` bytes allocated with `alloc_buffer`, unless `ptr` is NULL
+ */
+static void
+free_buffer(const struct Btree *restrict btree, void *restrict ptr, size_t size)
+{
+	if (ptr != NULL)
+		pool_free_object(btree->pool, ptr, size > 0 ? size : 1);
+}
+
+/*
+ * Adds `size` bytes to a buffer being laid out, which is `*buffer_size` bytes
+ * so far, and returns where they start.  Each part starts aligned to
+ * `max_align_t`.
+ */
+static size_t
+lay_out(size_t *buffer_size, size_t size)
+{
+	size_t offset = *buffer_size;
+	*buffer_size += (size + alignof(max_align_t) - 1) / alignof(max_align_t) * alignof(max_align_t);
+	return offset;
+}
+
+/*
+ * Frees a single leaf node
+ */
+static void
+free_leaf(const struct Btree *restrict btree, struct Btree_Node *restrict leaf)
+{
+	pool_free(btree->pool, POOL_LEAF, leaf);
+}
+
+/*
+ * Frees a single branch node, but not its children
+ */
+static void
+free_branch(const struct Btree *restrict btree, struct Btree_Node *restrict branch)
+{
+	pool_free(btree->pool, POOL_BRANCH, branch);
+}
+
+/*
+ * Creates a new btree as described by `config`.  See `struct Btree_Config`.  If
+ * `config->compare` is NULL, the btree is in sequence mode: entries are placed
+ * by index with `btree_insert_at`, and branches hold no keys.  Returns NULL if
+ * the allocator of the btree fails.
+ */
+struct Btree *
+btree_new_config(const struct Btree_Config *config)
+{
+	struct Btree tmp;
+	struct Btree *btree = &tmp;
+	btree->entry_size = config->entry_size;
+	btree->compare = config->compare;
+	btree->compare_cb_data = config->compare_cb_data;
+	btree->normalize = config->normalize != NULL ? config->normalize : get_compare_normalize(config->compare);
+	if (btree->compare == NULL)
+		btree->normalize = NULL;
+	/* A built-in comparison function makes its key type built in */
+	enum Btree_Key_Type key_type = config->key_type;
+	if (key_type == BTREE_KEY_CUSTOM && config->compare != NULL)
+		key_type = get_compare_key_type(config->compare);
+	if (key_type != BTREE_KEY_CUSTOM) {
+		btree->compare = get_key_compare(key_type);
+		btree->compare_cb_data = NULL;
+		btree->normalize = NULL;
+	}
+	btree->string_keys = key_type == BTREE_KEY_STRING;
+	btree->key_offset = config->key_offset;
+	btree->key_size = config->key_size;
+	/* Searches read keys of a built-in type whole, a key apart */
+	if (get_key_type_size(key_type) != 0 && btree->key_size != 0 && btree->key_size != get_key_type_size(key_type))
+		die("Attempted to create a btree with keys of a built-in type but a different size.");
+	if (btree->key_size == 0)
+		btree->key_size = btree->string_keys ? STRING_SEPARATOR_SIZE : get_key_type_size(key_type);
+	if (btree->key_size == 0 && config->key_offset < config->entry_size)
+		btree->key_size = config->entry_size - config->key_offset;
+	/* The key of an entry with a string key is a pointer, whatever size its separators are */
+	size_t entry_key_size = btree->string_keys ? sizeof(const char *) : btree->key_size;
+	if (btree->key_size == 0 || config->key_offset + entry_key_size > config->entry_size)
+		die("Attempted to create a btree with keys outside of its entries.");
+	if (btree->string_keys && (btree->key_size < 2 || btree->key_size > STRING_SEPARATOR_SIZE_MAX))
+		die("Attempted to create a btree with string separators of an unsupported size.");
+	btree->inline_keys = config->inline_keys;
+	btree->leaf_bytes = 0;
+	if (btree->inline_keys && (!btree->string_keys || config->leaf_node_size == 0))
+		die("Attempted to create a btree with inline keys that aren't strings or leaves that aren't sized in bytes.");
+	if (btree->compare == NULL)
+		btree->key_size = 0;
+	btree->key_search = get_key_search(key_type, config->entry_size);
+	btree->branch_key_search = get_key_search(key_type, btree->key_size);
+	/* Branches store normalized keys after their keys */
+	if (btree->normalize != NULL)
+		btree->key_size += sizeof(uint64_t);
+	btree->entry_count = 0;
+	btree->duplicates = config->duplicates;
+	btree->counts = config->counts;
+	btree->count_scan = get_count_scan();
+
+	btree->leaf_entry_count_max = config->leaf_entry_count_max;
+	size_t leaf_alignment = 0;
+	if (config->leaf_node_size != 0) {
+		btree->leaf_entry_count_max = get_leaf_entry_count_max(btree, config->leaf_node_size);
+		leaf_alignment = get_node_alignment(config->leaf_node_size);
+	}
+	if (btree->inline_keys) {
+		size_t bytes = config->leaf_node_size - sizeof(struct Btree_Node) - sizeof(struct Leaf_Heap);
+		btree->leaf_bytes = bytes / alignof(struct Leaf_Heap) * alignof(struct Leaf_Heap);
+		if (get_entry_load_max(btree) <= btree->entry_size)
+			die("Attempted to create a btree with leaves too small for four entries with inline keys.");
+	}
+	btree->branch_child_count_max = config->branch_child_count_max;
+	size_t branch_alignment = 0;
+	if (config->branch_node_size != 0) {
+		btree->branch_child_count_max = get_branch_child_count_max(btree, config->branch_node_size);
+		branch_alignment = get_node_alignment(config->branch_node_size);
+	}
+	btree->prefetch_size = 0;
+	if (config->prefetch) {
+		size_t leaf_size = get_leaf_size(btree);
+		size_t branch_size = get_branch_size(btree);
+		btree->prefetch_size = leaf_size > branch_size ? leaf_size : branch_size;
+		if (btree->prefetch_size > PREFETCH_BYTES_MAX)
+			btree->prefetch_size = PREFETCH_BYTES_MAX;
+	}
+	btree->pool = pool_new(config->allocator, get_leaf_size(btree), leaf_alignment, get_branch_size(btree), branch_alignment);
+	if (btree->pool == NULL)
+		return NULL;
+	btree = pool_alloc_object(tmp.pool, sizeof(struct Btree));
+	tmp.scratch = tmp.inline_keys ? alloc_buffer(&tmp, get_scratch_size(&tmp)) : NULL;
+	if (btree == NULL || (tmp.inline_keys && tmp.scratch == NULL) || !reserve_nodes(&tmp, 1, 0)) {
+		if (btree != NULL)
+			pool_free_object(tmp.pool, btree, sizeof(struct Btree));
+		free_buffer(&tmp, tmp.scratch, get_scratch_size(&tmp));
+		pool_release(tmp.pool);
+		return NULL;
+	}
+	*btree = tmp;
+	btree->root = create_leaf(btree, 0);
+	btree->last_leaf = btree->root;
+	return btree;
+}
+
+/*
+ * Creates a new btree that rejects duplicate entries.  `branch_child_count_max`
+ * must be at least 4.  `leaf_entry_count_max` must be at least 2.  In
+ * practice, both of these values will be significantly larger than those
+ * minima, and `leaf_entry_count_max` should probably be greater than
+ * `branch_child_count_max` for best performance.
+ */
+struct Btree *
+btree_new(size_t branch_child_count_max, size_t leaf_entry_count_max, size_t entry_size, Btree_Compare *compare, const void *compare_cb_data)
+{
+	return btree_new_config(&(struct Btree_Config) {
+		.branch_child_count_max = branch_child_count_max,
+		.leaf_entry_count_max = leaf_entry_count_max,
+		.entry_size = entry_size,
+		.compare = compare,
+		.compare_cb_data = compare_cb_data,
+	});
+}
+
+/*
+ * Creates a btree whose branches and leaves take `branch_node_size` and
+ * `leaf_node_size` bytes, such as 256 and 4096, with as many children and
+ * entries as fit in them.  Branches must fit at least 4 children, and leaves
+ * at least 2 entries.
+ */
+struct Btree *
+btree_new_sized(size_t branch_node_size, size_t leaf_node_size, size_t entry_size, Btree_Compare *compare, const void *compare_cb_data)
+{
+	return btree_new_config(&(struct Btree_Config) {
+		.branch_node_size = branch_node_size,
+		.leaf_node_size = leaf_node_size,
+		.entry_size = entry_size,
+		.compare = compare,
+		.compare_cb_data = compare_cb_data,
+	});
+}
+
+/*
+ * Frees a node and all of its children (if it has any).  The children are
+ * visited depth first, and each branch is freed after its last child.
+ */
+static void
+free_node(struct Btree *restrict btree, struct Btree_Node *restrict node)
+{
+	struct Path path;
+	path.length = 0;
+	for (;;) {
+		while (node->child_count != 0) {
+			path_push(&path, node, 0);
+			node = *get_branch_child_ptr_ptr(btree, node, 0);
+		}
+		free_leaf(btree, node);
+
+		/* Go back up to the first branch with children left */
+		for (;;) {
+			if (path.length == 0)
+				return;
+			struct Btree_Node *branch = path.branches[path.length - 1];
+			size_t child_index = ++path.child_indices[path.length - 1];
+			if (child_index < branch->child_count) {
+				node = *get_branch_child_ptr_ptr(btree, branch, child_index);
+				break;
+			}
+			free_branch(btree, branch);
+			path.length--;
+		}
+	}
+}
+
+/*
+ * Frees a btree.  Unless its pool is shared with other btrees, the nodes are
+ * freed along with the pool, a block at a time, without visiting them.
+ */
+void
+btree_free(struct Btree *btree)
+{
+	struct Node_Pool *pool = btree->pool;
+	if (pool_is_shared(pool))
+		free_node(btree, btree->root);
+	free_buffer(btree, btree->scratch, get_scratch_size(btree));
+	pool_free_object(pool, btree, sizeof(struct Btree));
+	pool_release(pool);
+}
+
+/*
+ * Returns the height of a btree, which is 0 if the root is a leaf
+ */
+static size_t
+get_height(const struct Btree *btree)
+{
+	size_t height = 0;
+	for (const struct Btree_Node *node = btree->root; node->child_count != 0; node = *get_branch_child_ptr_ptr(btree, node, 0))
+		height++;
+	return height;
+}
+
+/*
+ * Gets a pointer to the first entry in a node
+ */
+static const void *
+get_first_entry_ptr(const struct Btree *restrict btree, const struct Btree_Node *restrict node)
+{
+	while (node->child_count != 0)
+		node = *get_branch_child_ptr_ptr(btree, node, 0);
+	return get_leaf_entry_ptr(btree, node, 0);
+}
+
+/*
+ * Gets a pointer to the key of the first entry in a node
+ */
+static const void *
+get_first_key_ptr(const struct Btree *restrict btree, const struct Btree_Node *restrict node)
+{
+	return get_entry_key(btree, get_first_entry_ptr(btree, node));
+}
+
+/*
+ * Gets a pointer to the key of the last entry in a node
+ */
+static const void *
+get_last_key_ptr(const struct Btree *restrict btree, const struct Btree_Node *restrict node)
+{
+	while (node->child_count != 0)
+		node = *get_branch_child_ptr_ptr(btree, node, node->child_count - 1);
+	return get_entry_key(btree, get_leaf_entry_ptr(btree, node, node->entry_count - 1));
+}
+
+/*
+ * Stores the key placed between the node `left` and the node after it, whose
+ * first key is `key`, at `dst`.  String keys are cut short to a separator
+ * that tells the two nodes apart, and custom keys are followed by their
+ * normalized keys if the btree normalizes them.
+ */
+static void
+store_key(const struct Btree *restrict btree, void *restrict dst, const struct Btree_Node *restrict left, const void *restrict key)
+{
+	if (!btree->string_keys) {
+		size_t size = btree->key_size;
+		if (btree->normalize != NULL) {
+			size -= sizeof(uint64_t);
+			uint64_t normalized = normalize_key(btree, key);
+			memcpy((uint8_t *) dst + size, &normalized, sizeof(uint64_t));
+		}
+		memcpy(dst, key, size);
+		return;
+	}
+	const char *left_string, *right_string;
+	memcpy(&left_string, get_last_key_ptr(btree, left), sizeof(const char *));
+	memcpy(&right_string, key, sizeof(const char *));
+	encode_separator(dst, btree->key_size, left_string, right_string);
+}
+
+/*
+ * Compares the key in a branch at `key_index` with `target_key`, whose
+ * normalized key is `target_normalized`.  A truncated string separator that
+ * the target starts with is decided by the first key of the child after it,
+ * which the target can't come after without coming after the separator.
+ */
+static int
+compare_branch_key(const struct Btree *restrict btree, const struct Btree_Node *restrict branch, size_t key_index, const void *restrict target_key, uint64_t target_normalized)
+{
+	const void *key = get_branch_key_ptr(btree, branch, key_index);
+	if (btree->normalize != NULL) {
+		uint64_t normalized;
+		memcpy(&normalized, (const uint8_t *) key + btree->key_size - sizeof(uint64_t), sizeof(uint64_t));
+		return compare_normalized(btree, key, normalized, target_key, target_normalized);
+	}
+	if (!btree->string_keys)
+		return compare(btree, key, target_key);
+
+	const char *target;
+	memcpy(&target, target_key, sizeof(const char *));
+	bool undecided = false;
+	int comparison = compare_separator(key, target, &undecided);
+	if (undecided)
+		comparison = compare(btree, get_first_key_ptr(btree, *get_branch_child_ptr_ptr(btree, branch, key_index)), target_key);
+	return comparison;
+}
+
+/*
+ * Conducts a binary search on a btree leaf.  Returns the index of the first
+ * entry that does not come before the target, or, if `upper` is true, of the
+ * first entry that comes after the target.
+ */
+static size_t
+leaf_search(const struct Btree *restrict btree, const struct Btree_Node *restrict leaf, const void *restrict target_key, bool upper)
+{
+	if (btree->key_search != NULL)
+		return btree->key_search(get_entry_key(btree, get_leaf_entry_ptr(btree, leaf, 0)), btree->entry_size, leaf->entry_count, target_key, upper);
+
+	size_t low = 0;
+	size_t high = leaf->entry_count;
+	uint64_t target_normalized = normalize_key(btree, target_key);
+	while (low != high) {
+		size_t middle = (low + high) / 2;
+		const void *key = get_entry_key(btree, get_leaf_entry_ptr(btree, leaf, middle));
+		int comparison = btree->normalize != NULL ?
+			compare_normalized(btree, key, get_leaf_normalized_keys(btree, leaf)[middle], target_key, target_normalized) :
+			compare(btree, key, target_key);
+		if (comparison < 0 || (comparison == 0 && !upper))
+			high = middle;
+		else
+			low = middle + 1;
+	}
+	return low;
+}
+
+/*
+ * Conducts a binary search on a btree branch.  Returns the index of the last
+ * child whose key comes before the target, or, if `upper` is true, whose key
+ * does not come after the target.  If there is no such key, 0 is returned,
+ * since the first child has no key.
+ */
+static size_t
+branch_search(const struct Btree *restrict btree, const struct Btree_Node *restrict branch, const void *restrict target_key, bool upper)
+{
+	/* The keys from the second child onward are counted */
+	if (btree->branch_key_search != NULL)
+		return btree->branch_key_search(get_branch_key_ptr(btree, branch, 1), btree->key_size, branch->child_count - 1, target_key, upper);
+
+	size_t low = 0;
+	size_t high = branch->child_count - 1;
+	uint64_t target_normalized = normalize_key(btree, target_key);
+	while (low != high) {
+		size_t middle = (low + high + 1) / 2;
+		int comparison = compare_branch_key(btree, branch, middle, target_key, target_normalized);
+		if (comparison < 0 || (comparison == 0 && !upper))
+			high = middle - 1;
+		else
+			low = middle;
+	}
+	return low;
+}
+
+/*
+ * Returns true if `entry` can be inserted into a leaf without splitting it
+ */
+static bool
+leaf_has_room(const struct Btree *restrict btree, const struct Btree_Node *restrict leaf, const void *restrict entry)
+{
+	if (!btree->inline_keys)
+		return leaf->entry_count < btree->leaf_entry_count_max;
+	return get_leaf_load(btree, leaf) + get_entry_load(btree, entry) <= btree->leaf_bytes;
+}
+
+/*
+ * Inserts an entry into a leaf at the specified index, and returns a pointer
+ * to where it is stored.  The leaf MUST have room for the entry when calling
+ * this function.  With inline keys, the entry's string is copied into the
+ * leaf, after dropping the strings left behind in it if they're in the way.
+ */
+static void *
+leaf_insert(const struct Btree *restrict btree, struct Btree_Node *restrict leaf, size_t insertion_index, const void *restrict entry)
+{
+	size_t length = 0;
+	if (btree->inline_keys) {
+		length = strlen(get_entry_string(btree, entry)) + 1;
+		if ((leaf->entry_count + 1) * btree->entry_size + length > get_leaf_heap(btree, leaf)->start)
+			repack_strings(btree, leaf);
+	}
+
+	void *stored = get_leaf_entry_ptr(btree, leaf, insertion_index);
+	memmove(get_leaf_entry_ptr(btree, leaf, insertion_index + 1), stored, btree->entry_size * (leaf->entry_count - insertion_index));
+	memcpy(stored, entry, btree->entry_size);
+	if (btree->normalize != NULL) {
+		uint64_t *normalized = get_leaf_normalized_keys(btree, leaf);
+		memmove(&normalized[insertion_index + 1], &normalized[insertion_index], (leaf->entry_count - insertion_index) * sizeof(uint64_t));
+		normalized[insertion_index] = normalize_key(btree, get_entry_key(btree, entry));
+	}
+	leaf->entry_count++;
+
+	if (btree->inline_keys) {
+		struct Leaf_Heap *heap = get_leaf_heap(btree, leaf);
+		heap->start -= length;
+		heap->used += length;
+		memcpy(leaf->data + heap->start, get_entry_string(btree, entry), length);
+		set_entry_string(btree, stored, (const char *) leaf->data + heap->start);
+	}
+	return stored;
+}
+
+/*
+ * Overwrites an entry in a leaf with `entry`, which matches it.  With inline
+ * keys, the entry keeps the copy of its key that is already in the leaf.
+ */
+static void
+overwrite_entry(const struct Btree *restrict btree, void *restrict match, const void *restrict entry)
+{
+	const char *string = btree->inline_keys ? get_entry_string(btree, match) : NULL;
+	memcpy(match, entry, btree->entry_size);
+	if (btree->inline_keys)
+		set_entry_string(btree, match, string);
+}
+
+/*
+ * Returns the number of entries at the start of the leaf `left`, followed by
+ * the leaf `right`, if it isn't NULL, that evens out the load of the entries
+ * before and after them.  At least one entry is left on either side.
+ */
+static size_t
+get_balanced_index(const struct Btree *restrict btree, const struct Btree_Node *restrict left, const struct Btree_Node *restrict right)
+{
+	size_t count = left->entry_count + (right != NULL ? right->entry_count : 0);
+	if (!btree->inline_keys)
+		return count / 2;
+
+	size_t half = (get_leaf_load(btree, left) + (right != NULL ? get_leaf_load(btree, right) : 0)) / 2;
+	size_t load = 0;
+	size_t index = 0;
+	for (; index < count - 1; index++) {
+		const void *entry = index < left->entry_count ?
+			get_leaf_entry_ptr(btree, left, index) :
+			get_leaf_entry_ptr(btree, right, index - left->entry_count);
+		load += get_entry_load(btree, entry);
+		if (load > half)
+			break;
+	}
+	return index > 0 ? index : 1;
+}
+
+/*
+ * Checks whether the entry before `index` in a leaf matches `entry`, in which
+ * case, unless the btree allows duplicates, `entry` must not be inserted at
+ * `index`.  Returns a pointer to the matching entry, or NULL if there is none
+ * or the btree allows duplicates.
+ */
+static void *
+find_duplicate(const struct Btree *restrict btree, const struct Btree_Node *restrict leaf, size_t index, const void *restrict entry)
+{
+	if (index == 0 || btree->duplicates == BTREE_DUPLICATES_ALLOW)
+		return NULL;
+	void *match = get_leaf_entry_ptr(btree, leaf, index - 1);
+	return compare_entries(btree, match, entry) == 0 ? match : NULL;
+}
+
+/*
+ * Inserts a child into a branch at the specified index.  The branch MUST
+ * NOT be full when calling this function.  `child_index` MUST BE GREATER THAN
+ * ZERO.
+ */
+static void
+branch_insert(const struct Btree *restrict btree, struct Btree_Node *restrict branch, const void *restrict key, size_t child_index, struct Btree_Node *restrict child)
+{
+	size_t moved = branch->child_count - child_index;
+	memmove(get_branch_child_ptr_ptr(btree, branch, child_index + 1), get_branch_child_ptr_ptr(btree, branch, child_index), moved * sizeof(struct Btree_Node *));
+	memmove(get_branch_key_ptr(btree, branch, child_index + 1), get_branch_key_ptr(btree, branch, child_index), moved * btree->key_size);
+	store_key(btree, get_branch_key_ptr(btree, branch, child_index), *get_branch_child_ptr_ptr(btree, branch, child_index - 1), key);
+	*get_branch_child_ptr_ptr(btree, branch, child_index) = child;
+	branch->child_count++;
+
+	/*
+	 * Update the counts array.  Cumulative counts after the new child
+	 * include the entry that was inserted to split the child before it.
+	 */
+	size_t *counts = get_branch_counts(btree, branch);
+	if (btree->counts == BTREE_COUNTS_PER_CHILD) {
+		if (child_index < branch->child_count - 1) {
+			memmove(&counts[child_index + 1], &counts[child_index], (branch->child_count - 2 - child_index) * sizeof(size_t));
+			counts[child_index] = child->entry_count;
+		}
+		return;
+	}
+	for (size_t i = branch->child_count - 2; i > child_index; i--)
+		counts[i] = counts[i - 1] + 1;
+	if (child_index < btree->branch_child_count_max - 1)
+		counts[child_index] = counts[child_index - 1] + child->entry_count;
+}
+
+/*
+ * Sets the entry count of the child of a branch at `index` to `entry_count`.
+ * A cumulative count is set to `entry_count` plus the count of the preceding
+ * child, and the counts of the following children are not updated.
+ */
+static void
+set_child_entry_count(const struct Btree *restrict btree, const struct Btree_Node *restrict branch, size_t index, size_t entry_count)
+{
+	size_t *counts = get_branch_counts(btree, branch);
+	if (index == btree->branch_child_count_max - 1)
+		return;
+	counts[index] = entry_count;
+	if (index > 0 && btree->counts == BTREE_COUNTS_CUMULATIVE)
+		counts[index] += counts[index - 1];
+}
+
+/*
+ * Adds `change` to the entry count of the child of a branch at `index`.  The
+ * entry count of the branch itself is not updated.
+ */
+static void
+change_child_entry_count(const struct Btree *restrict btree, const struct Btree_Node *restrict branch, size_t index, ptrdiff_t change)
+{
+	size_t *counts = get_branch_counts(btree, branch);
+	if (btree->counts == BTREE_COUNTS_PER_CHILD) {
+		if (index < branch->child_count - 1)
+			counts[index] += change;
+		return;
+	}
+	for (size_t i = index; i < branch->child_count - 1; i++)
+		counts[i] += change;
+}
+
+/*
+ * Returns the number of entries in the children of a branch before the one at
+ * `index`
+ */
+static size_t
+get_child_offset(const struct Btree *restrict btree, const struct Btree_Node *restrict branch, size_t index)
+{
+	const size_t *counts = get_branch_counts(btree, branch);
+	if (btree->counts == BTREE_COUNTS_CUMULATIVE)
+		return index > 0 ? counts[index - 1] : 0;
+
+	size_t offset = 0;
+	for (size_t i = 0; i < index; i++)
+		offset += counts[i];
+	return offset;
+}
+
+/*
+ * Moves `count` entries of the leaf `src`, starting at `src_index`, to
+ * `dst_index` in the leaf `dst`, along with their normalized keys.  The
+ * ranges may overlap.
+ */
+static void
+move_leaf_entries(const struct Btree *btree, struct Btree_Node *dst, size_t dst_index, const struct Btree_Node *src, size_t src_index, size_t count)
+{
+	memmove(get_leaf_entry_ptr(btree, dst, dst_index), get_leaf_entry_ptr(btree, src, src_index), count * btree->entry_size);
+	if (btree->normalize != NULL)
+		memmove(&get_leaf_normalized_keys(btree, dst)[dst_index], &get_leaf_normalized_keys(btree, src)[src_index], count * sizeof(uint64_t));
+}
+
+/*
+ * Moves the entries of a leaf from `index` onward to a new leaf, which is
+ * linked in after it and returned
+ */
+static struct Btree_Node *
+split_leaf(const struct Btree *restrict btree, struct Btree_Node *restrict leaf, size_t index)
+{
+	/* With inline keys, the strings of both leaves are rebuilt, unless none move */
+	bool repack = btree->inline_keys && index < leaf->entry_count;
+	if (repack)
+		evacuate_strings(btree, leaf, btree->scratch);
+
+	struct Btree_Node *new_leaf = create_leaf(btree, leaf->entry_count - index);
+	move_leaf_entries(btree, new_leaf, 0, leaf, index, new_leaf->entry_count);
+	leaf->entry_count = index;
+	if (repack) {
+		adopt_strings(btree, new_leaf);
+		adopt_strings(btree, leaf);
+	}
+
+	new_leaf->prev = leaf;
+	new_leaf->next = leaf->next;
+	if (leaf->next != NULL)
+		leaf->next->prev = new_leaf;
+	leaf->next = new_leaf;
+	return new_leaf;
+}
+
+/*
+ * Moves `count` child pointers of the branch `src`, starting at `src_index`,
+ * to `dst_index` in the branch `dst`, along with the keys in front of them.
+ * The ranges may overlap.  Since the first child of a branch has no key, a
+ * child moved away from index 0 is left without a key, which the caller must
+ * then set.  The counts arrays are not updated.
+ */
+static void
+move_branch_children(const struct Btree *btree, struct Btree_Node *dst, size_t dst_index, const struct Btree_Node *src, size_t src_index, size_t count)
+{
+	if (count == 0)
+		return;
+	memmove(get_branch_child_ptr_ptr(btree, dst, dst_index), get_branch_child_ptr_ptr(btree, src, src_index), count * sizeof(struct Btree_Node *));
+
+	/* If either of the first children is moved, it has no key to move */
+	size_t keyless = dst_index == 0 || src_index == 0;
+	memmove(get_branch_key_ptr(btree, dst, dst_index + keyless), get_branch_key_ptr(btree, src, src_index + keyless), (count - keyless) * btree->key_size);
+}
+
+/*
+ * Recomputes the counts array and the entry count of a branch from the entry
+ * counts of its children
+ */
+static void
+recount_branch(const struct Btree *restrict btree, struct Btree_Node *restrict branch)
+{
+	size_t *counts = get_branch_counts(btree, branch);
+	size_t total = 0;
+	for (size_t i = 0; i < branch->child_count; i++) {
+		size_t entry_count = (*get_branch_child_ptr_ptr(btree, branch, i))->entry_count;
+		total += entry_count;
+		if (i + 1 < branch->child_count)
+			counts[i] = btree->counts == BTREE_COUNTS_CUMULATIVE ? total : entry_count;
+	}
+	branch->entry_count = total;
+}
+
+/*
+ * Finds the child of a branch that contains the entry at `*entry_index`.
+ * Returns the index of the child, and sets `*entry_index` to the index of the
+ * entry within that child.
+ */
+static size_t
+find_child_by_index(const struct Btree *restrict btree, const struct Btree_Node *restrict branch, size_t *restrict entry_index)
+{
+	size_t *counts = get_branch_counts(btree, branch);
+	/* Subtract the counts of the children before the entry */
+	if (btree->counts == BTREE_COUNTS_PER_CHILD)
+		return btree->count_scan(counts, branch->child_count - 1, entry_index);
+
+	size_t low = 0;
+	size_t high = branch->child_count - 1;
+	while (low != high) {
+		size_t middle = (low + high) / 2;
+		if (counts[middle] > *entry_index)
+			high = middle;
+		else
+			low = middle + 1;
+	}
+	if (low > 0)
+		*entry_index -= counts[low - 1];
+	return low;
+}
+
+/*
+ * The state of an insertion into a btree
+ */
+struct Insertion {
+	/* The entry being inserted */
+	const void *entry;
+	/*
+	 * Whether the entry is inserted at `index` instead of at the position
+	 * its key belongs at
+	 */
+	bool positional;
+	size_t index;
+	/* Set to the outcome of the insertion */
+	enum Btree_Insert_Result result;
+	/* Set to where the entry is stored, or to the entry that rejected it */
+	void *stored;
+	/*
+	 * Set to a pointer to the entry that should be used as the key placed
+	 * in front of a node created by a split
+	 */
+	const void *key;
+	/*
+	 * Set when the last leaf is split by moving only the new entry to a new
+	 * leaf, so that the branches above it are split the same way
+	 */
+	bool appended;
+};
+
+/*
+ * Inserts an entry into a leaf.  If the leaf is full, then it is split into
+ * two, and the newly created leaf, which contains the upper half of the
+ * original leaf, is returned.  In that case, `insertion->key` is set to a
+ * pointer to the entry that should be used as the key placed between the two
+ * leaves in their parent.  If no new leaf is created, then NULL is returned.
+ * `rightmost` must be true if the leaf is the last leaf.
+ */
+static struct Btree_Node *
+leaf_insert_split(const struct Btree *restrict btree, struct Btree_Node *restrict node, struct Insertion *restrict insertion, bool rightmost)
+{
+	size_t index = insertion->index;
+	void *match = NULL;
+	if (!insertion->positional) {
+		index = leaf_search(btree, node, get_entry_key(btree, insertion->entry), true);
+		match = find_duplicate(btree, node, index, insertion->entry);
+	}
+	if (match != NULL) {
+		if (btree->duplicates == BTREE_DUPLICATES_OVERWRITE) {
+			overwrite_entry(btree, match, insertion->entry);
+			insertion->result = BTREE_OVERWRITTEN;
+		} else {
+			insertion->result = BTREE_REJECTED;
+		}
+		insertion->stored = match;
+		return NULL;
+	}
+	insertion->result = BTREE_INSERTED;
+
+	if (!leaf_has_room(btree, node, insertion->entry)) {
+		/*
+		 * Split the leaf in half, by load, unless the entry goes at
+		 * the end of the btree.  In that case, the old leaf keeps all
+		 * of its entries and the new leaf only gets the new one, so
+		 * that entries inserted in ascending order fill their leaves
+		 * instead of leaving them half empty.
+		 */
+		bool appending = rightmost && index == node->entry_count;
+		size_t middle_index = appending ? node->entry_count : get_balanced_index(btree, node, NULL);
+		struct Btree_Node *new_leaf = split_leaf(btree, node, middle_index);
+		insertion->appended = appending;
+
+		/* Now insert the new entry */
+		if (appending || index > middle_index)
+			insertion->stored = leaf_insert(btree, new_leaf, index - middle_index, insertion->entry);
+		else
+			insertion->stored = leaf_insert(btree, node, index, insertion->entry);
+
+		insertion->key = get_entry_key(btree, get_leaf_entry_ptr(btree, new_leaf, 0));
+		return new_leaf;
+	}
+
+	insertion->stored = leaf_insert(btree, node, index, insertion->entry);
+	return NULL;
+}
+
+/*
+ * Adds `new_child`, split off from the child of a branch at `child_index`,
+ * after that child, and adds one to the entry counts of the branch for the
+ * entry inserted into the children.  If the branch is full, it is split like a
+ * leaf in `leaf_insert_split`, and the new branch is returned.  Otherwise NULL
+ * is returned.  `child_rightmost` must be true if the child at `child_index`
+ * is on the path from the root to the last leaf.
+ */
+static struct Btree_Node *
+branch_insert_split(const struct Btree *restrict btree, struct Btree_Node *restrict node, size_t child_index, struct Btree_Node *restrict new_child, bool child_rightmost, struct Insertion *restrict insertion)
+{
+	struct Btree_Node *child = *get_branch_child_ptr_ptr(btree, node, child_index);
+	size_t new_child_index = child_index + 1;
+
+	if (node->child_count == btree->branch_child_count_max) {
+		/*
+		 * This branch is full, so it must be split.  If the new child
+		 * was split off the end of the btree by an append, the old
+		 * branch keeps all but its last child, which moves to the new
+		 * branch along with the new child, so that the old branch is
+		 * left one child short of full.  Any other split, including one
+		 * of the rightmost child, splits the branch in half.
+		 */
+		size_t middle_index = btree->branch_child_count_max / 2;
+		if (child_rightmost && insertion->appended)
+			middle_index = node->child_count - 1;
+		node->child_count = middle_index;
+
+		/*
+		 * Create a new branch and copy its child pointers and keys
+		 * from the other branch (`node`)
+		 */
+		struct Btree_Node *new_branch = create_branch(btree, btree->branch_child_count_max - middle_index, 0);
+		move_branch_children(btree, new_branch, 0, node, middle_index, new_branch->child_count);
+
+		/* Update entry counts */
+		size_t tmp = node->entry_count;
+		node->entry_count = get_child_offset(btree, node, middle_index);
+		new_branch->entry_count = tmp - node->entry_count;
+
+		/* Set the counts array for the new branch */
+		size_t *counts = get_branch_counts(btree, node);
+		size_t *new_counts = get_branch_counts(btree, new_branch);
+		size_t subtracted = btree->counts == BTREE_COUNTS_CUMULATIVE ? node->entry_count : 0;
+		for (size_t i = 0; i < new_branch->child_count - 1; i++)
+			new_counts[i] = counts[middle_index + i] - subtracted;
+
+		/*
+		 * Determine which of the two branches `new_child` should be
+		 * inserted into.
+		 */
+		struct Btree_Node *target_branch;
+		if (child_index < middle_index) {
+			target_branch = node;
+		} else {
+			target_branch = new_branch;
+			child_index -= middle_index;
+			new_child_index -= middle_index;
+		}
+
+		/* Update the entry count at `child_index` */
+		set_child_entry_count(btree, target_branch, child_index, child->entry_count);
+
+		/*
+		 * Insert the new child.  This will also update the rest of
+		 * the counts array.
+		 */
+		branch_insert(btree, target_branch, insertion->key, new_child_index, new_child);
+
+		/*
+		 * We haven't incremented the entry count from the insertion
+		 * yet, so do it now
+		 */
+		target_branch->entry_count++;
+
+		insertion->key = get_first_key_ptr(btree, new_branch);
+		return new_branch;
+	}
+
+	/* Update the entry count at `child_index` */
+	set_child_entry_count(btree, node, child_index, child->entry_count);
+
+	/*
+	 * Insert the new child.  This will also update the rest of the counts
+	 * array.
+	 */
+	branch_insert(btree, node, insertion->key, new_child_index, new_child);
+	node->entry_count++;
+	return NULL;
+}
+
+/*
+ * Inserts an entry into the subtree under `node`, which must be the root of
+ * the btree.  The descent records its path, and the splits and entry count
+ * changes are applied to the branches on it on the way back up.  If the node
+ * is split, the new node holding its upper half is returned, and
+ * `insertion->key` is set to its key.  Otherwise NULL is returned.  Entries
+ * are inserted after any entries that match them, unless the insertion is
+ * positional, in which case `insertion->index` is the index of the entry.
+ */
+static struct Btree_Node *
+node_insert(const struct Btree *restrict btree, struct Btree_Node *restrict node, struct Insertion *restrict insertion)
+{
+	/*
+	 * The first `rightmost_length` branches on the path follow their last
+	 * child, so they lead to the last leaf
+	 */
+	struct Path path;
+	path.length = 0;
+	size_t rightmost_length = 0;
+	while (node->child_count != 0) {
+		/*
+		 * A key in a branch can match the entry without the entry
+		 * being in the btree, since keys are left in place when
+		 * entries are removed.  Leave it to the leaf to detect
+		 * duplicates.
+		 */
+		size_t child_index;
+		if (insertion->positional)
+			child_index = find_child_by_index(btree, node, &insertion->index);
+		else
+			child_index = branch_search(btree, node, get_entry_key(btree, insertion->entry), true);
+
+		if (rightmost_length == path.length && child_index == node->child_count - 1)
+			rightmost_length++;
+		path_push(&path, node, child_index);
+		node = get_child(btree, node, child_index);
+	}
+
+	struct Btree_Node *new_node = leaf_insert_split(btree, node, insertion, rightmost_length == path.length);
+	if (insertion->result != BTREE_INSERTED)
+		return NULL;
+
+	while (path.length > 0) {
+		path.length--;
+		struct Btree_Node *branch = path.branches[path.length];
+		size_t child_index = path.child_indices[path.length];
+		if (new_node != NULL) {
+			new_node = branch_insert_split(btree, branch, child_index, new_node, path.length < rightmost_length, insertion);
+		} else {
+			change_child_entry_count(btree, branch, child_index, 1);
+			branch->entry_count++;
+		}
+	}
+	return new_node;
+}
+
+/*
+ * Appends an entry to the last leaf if it goes at the end of the btree and the
+ * leaf isn't full.  No searching is needed: the entry is only compared with the
+ * last entry, or, for positional insertions, its index with the entry count of
+ * the btree, and the entry counts of the branches on the path to the last
+ * leaf are found by following the last child of each of them.  Since the last
+ * child of a branch isn't included in its counts array, only the entry counts
+ * need to be updated.  Returns false if the entry can't be
+ * appended this way.
+ */
+static bool
+append(struct Btree *restrict btree, struct Insertion *restrict insertion)
+{
+	struct Btree_Node *leaf = btree->last_leaf;
+	if (!leaf_has_room(btree, leaf, insertion->entry))
+		return false;
+	if (insertion->positional) {
+		if (insertion->index != btree->entry_count)
+			return false;
+	} else if (leaf->entry_count > 0) {
+		int comparison = compare_entries(btree, get_leaf_entry_ptr(btree, leaf, leaf->entry_count - 1), insertion->entry);
+		if (comparison < 0 || (comparison == 0 && btree->duplicates != BTREE_DUPLICATES_ALLOW))
+			return false;
+	}
+
+	insertion->stored = leaf_insert(btree, leaf, leaf->entry_count, insertion->entry);
+	insertion->result = BTREE_INSERTED;
+	for (struct Btree_Node *node = btree->root; node != leaf; node = *get_branch_child_ptr_ptr(btree, node, node->child_count - 1))
+		node->entry_count++;
+	return true;
+}
+
+/*
+ * Dies if an entry is too large to be inserted into a btree with inline keys,
+ * where an entry may take up to a quarter of a leaf
+ */
+static void
+require_entry_fits(const struct Btree *restrict btree, const void *restrict entry)
+{
+	if (get_entry_load(btree, entry) > get_entry_load_max(btree))
+		die("Attempted to insert an entry whose key is too long to store in a leaf.");
+}
+
+/*
+ * Carries out an insertion into a btree
+ */
+static void
+insert(struct Btree *restrict btree, struct Insertion *restrict insertion)
+{
+	require_entry_fits(btree, insertion->entry);
+
+	/* Each level may be split, and the root may get a new parent */
+	if (pool_can_fail(btree->pool) && !reserve_nodes(btree, 1, get_height(btree) + 1)) {
+		insertion->result = BTREE_FAILED;
+		insertion->stored = NULL;
+		return;
+	}
+
+	if (!append(btree, insertion)) {
+		struct Btree_Node *new_node = node_insert(btree, btree->root, insertion);
+		if (new_node != NULL) {
+			/*
+			 * The root was full and had to be split.  Construct a
+			 * new root that contains the original root and the new
+			 * node.
+			 */
+			struct Btree_Node *old_root = btree->root;
+			btree->root = create_branch(btree, 2, old_root->entry_count + new_node->entry_count);
+			*get_branch_child_ptr_ptr(btree, btree->root, 0) = old_root;
+			store_key(btree, get_branch_key_ptr(btree, btree->root, 1), old_root, insertion->key);
+			*get_branch_child_ptr_ptr(btree, btree->root, 1) = new_node;
+			get_branch_counts(btree, btree->root)[0] = old_root->entry_count;
+		}
+		if (btree->last_leaf->next != NULL)
+			btree->last_leaf = btree->last_leaf->next;
+	}
+
+	if (insertion->result == BTREE_INSERTED)
+		btree->entry_count++;
+}
+
+/*
+ * Dies if a btree is in sequence mode, in which operations that need to
+ * compare entries can't be used
+ */
+static void
+require_compare(const struct Btree *btree)
+{
+	if (btree->compare == NULL)
+		die("Attempted to look up or insert an entry by key in a btree in sequence mode.");
+}
+
+/*
+ * Inserts an entry into a btree.  Returns whether the entry was inserted, or,
+ * if it matches an entry in the btree, whether it overwrote that entry or was
+ * rejected, depending on how the btree handles duplicates, or
+ * `BTREE_FAILED`, leaving the btree unchanged, if the allocator of the btree
+ * fails.  Unless `stored` is NULL, `*stored` is set to a pointer to where the
+ * entry is stored, or to the matching entry if the entry was rejected (NULL if
+ * the insertion failed).  The pointer is valid until the btree is modified.
+ */
+enum Btree_Insert_Result
+btree_insert(struct Btree *restrict btree, const void *restrict entry, const void **restrict stored)
+{
+	require_compare(btree);
+	struct Insertion insertion = { .entry = entry };
+	insert(btree, &insertion);
+	if (stored != NULL)
+		*stored = insertion.stored;
+	return insertion.result;
+}
+
+/*
+ * Inserts an entry into a btree in sequence mode at `entry_index`, which may
+ * be the entry count of the btree, shifting the entries from that index onward
+ * up by one.  Returns a pointer to where the entry is stored, which is valid
+ * until the btree is modified, or NULL if the allocator of the btree fails.
+ */
+void *
+btree_insert_at(struct Btree *restrict btree, size_t entry_index, const void *restrict entry)
+{
+	if (btree->compare != NULL)
+		die("Attempted to insert an entry by index into a btree that isn't in sequence mode.");
+	if (entry_index > btree->entry_count)
+		die("Attempted to insert an entry past the end of a btree.");
+	struct Insertion insertion = {
+		.entry = entry,
+		.positional = true,
+		.index = entry_index,
+	};
+	insert(btree, &insertion);
+	return insertion.stored;
+}
+
+/*
+ * Returns the number of nodes to spread `item_count`-many items (entries or
+ * children) over when building nodes in bulk, given the maximum number of
+ * items in a node and the fill factor.  Unless there are too few items, each
+ * node gets at least half of the maximum, below which nodes are considered too
+ * small.
+ */
+static size_t
+get_node_count(size_t item_count, size_t max, double fill_factor)
+{
+	size_t min = max / 2 > 0 ? max / 2 : 1;
+	size_t size = (size_t) (max * fill_factor + 0.5);
+	if (size < min)
+		size = min;
+	if (size > max)
+		size = max;
+
+	size_t node_count = (item_count + size - 1) / size;
+	if (item_count / node_count < min) {
+		node_count = item_count / min;
+		if (node_count == 0)
+			node_count = 1;
+	}
+	return node_count;
+}
+
+/*
+ * Returns the load that leaves built in bulk are filled to at most, which,
+ * with inline keys, leaves room for an entry to cross into a leaf's share
+ */
+static size_t
+get_leaf_fill_max(const struct Btree *btree)
+{
+	return get_leaf_capacity(btree) - (btree->inline_keys ? get_entry_load_max(btree) : 0);
+}
+
+/*
+ * Returns how many of `count`-many entries, spaced an entry apart from
+ * `entries`, go to the leaf with the `index`th of `leaf_count`-many equal
+ * shares of `total_load`, where `*load` is the load of the entries before
+ * them.  An entry goes to the share it starts in.  `*load` is advanced past
+ * the entries.
+ */
+static size_t
+take_leaf_share(const struct Btree *restrict btree, const uint8_t *restrict entries, size_t count, size_t *restrict load, size_t total_load, size_t index, size_t leaf_count)
+{
+	size_t end = total_load / leaf_count * (index + 1) + total_load % leaf_count * (index + 1) / leaf_count;
+	size_t taken = 0;
+	for (; taken < count && *load < end; taken++)
+		*load += get_entry_load(btree, entries + taken * btree->entry_size);
+	return taken;
+}
+
+/*
+ * Builds levels of branches on top of the `node_count`-many nodes in `nodes`,
+ * the keys of whose first entries are in `first_keys`, until there is a single
+ * root, and returns the root.  Branches are filled to `fill_factor` of their
+ * capacity.  Each level is written over the start of the arrays as the one
+ * below it is read.
+ */
+static struct Btree_Node *
+build_branch_levels(const struct Btree *restrict btree, struct Btree_Node **restrict nodes, const void **restrict first_keys, size_t node_count, double fill_factor)
+{
+	while (node_count > 1) {
+		size_t branch_count = get_node_count(node_count, btree->branch_child_count_max, fill_factor);
+		size_t child_index = 0;
+		for (size_t i = 0; i < branch_count; i++) {
+			size_t count = node_count / branch_count + (i < node_count % branch_count);
+			struct Btree_Node *branch = create_branch(btree, count, 0);
+			const void *first_key = first_keys[child_index];
+			for (size_t j = 0; j < count; j++) {
+				*get_branch_child_ptr_ptr(btree, branch, j) = nodes[child_index + j];
+				if (j > 0)
+					store_key(btree, get_branch_key_ptr(btree, branch, j), nodes[child_index + j - 1], first_keys[child_index + j]);
+			}
+			recount_branch(btree, branch);
+			child_index += count;
+
+			nodes[i] = branch;
+			first_keys[i] = first_key;
+		}
+		node_count = branch_count;
+	}
+	return nodes[0];
+}
+
+/*
+ * Loads a sorted array of `entry_count`-many entries into an empty btree.
+ * Leaves are filled to `fill_factor` (between 0 and 1) of their capacity, and
+ * the branches above them are built level by level, which is much faster than
+ * inserting the entries one at a time.  Returns false, leaving the btree
+ * unchanged, if the btree is not empty, the fill factor is out of range, the
+ * entries are not sorted, an entry's key is too long to store in a leaf, or
+ * the allocator of the btree fails.  Unless
+ * the btree allows duplicates, the entries must not contain any.  In sequence
+ * mode, the entries are loaded in the order they are in.
+ */
+bool
+btree_bulk_load(struct Btree *restrict btree, const void *restrict entries, size_t entry_count, double fill_factor)
+{
+	if (btree->entry_count != 0 || !(0 < fill_factor && fill_factor <= 1))
+		return false;
+	for (size_t i = 1; i < entry_count && btree->compare != NULL; i++) {
+		const uint8_t *entry = (const uint8_t *) entries + i * btree->entry_size;
+		int comparison = compare_entries(btree, entry - btree->entry_size, entry);
+		if (comparison < 0 || (comparison == 0 && btree->duplicates != BTREE_DUPLICATES_ALLOW))
+			return false;
+	}
+	if (entry_count == 0)
+		return true;
+	size_t total_load = entry_count;
+	if (btree->inline_keys) {
+		total_load = 0;
+		for (size_t i = 0; i < entry_count; i++) {
+			const uint8_t *entry = (const uint8_t *) entries + i * btree->entry_size;
+			size_t entry_load = get_entry_load(btree, entry);
+			if (entry_load > get_entry_load_max(btree))
+				return false;
+			total_load += entry_load;
+		}
+	}
+
+	/*
+	 * Spread the entries evenly, by load, over just enough leaves to hold
+	 * them at the requested fill factor
+	 */
+	size_t node_count = get_node_count(total_load, get_leaf_fill_max(btree), fill_factor);
+	size_t branch_count = 0;
+	for (size_t count = node_count; count > 1; ) {
+		count = get_node_count(count, btree->branch_child_count_max, fill_factor);
+		branch_count += count;
+	}
+	if (!reserve_nodes(btree, node_count, branch_count))
+		return false;
+	size_t buffer_size = 0;
+	size_t nodes_offset = lay_out(&buffer_size, node_count * sizeof(struct Btree_Node *));
+	size_t first_keys_offset = lay_out(&buffer_size, node_count * sizeof(void *));
+	uint8_t *buffer = alloc_buffer(btree, buffer_size);
+	if (buffer == NULL)
+		return false;
+	struct Btree_Node **nodes = (struct Btree_Node **) (buffer + nodes_offset);
+	const void **first_keys = (const void **) (buffer + first_keys_offset);
+
+	const uint8_t *entry = entries;
+	size_t loaded = 0;
+	size_t load = 0;
+	struct Btree_Node *prev = NULL;
+	for (size_t i = 0; i < node_count; i++) {
+		size_t count = take_leaf_share(btree, entry, entry_count - loaded, &load, total_load, i, node_count);
+		struct Btree_Node *leaf = create_leaf(btree, count);
+		memcpy(get_leaf_entry_ptr(btree, leaf, 0), entry, count * btree->entry_size);
+		if (btree->inline_keys)
+			adopt_strings(btree, leaf);
+		if (btree->normalize != NULL)
+			normalize_entries(btree, leaf, 0, count);
+		entry += count * btree->entry_size;
+		loaded += count;
+
+		leaf->prev = prev;
+		if (prev != NULL)
+			prev->next = leaf;
+		prev = leaf;
+
+		nodes[i] = leaf;
+		first_keys[i] = get_entry_key(btree, get_leaf_entry_ptr(btree, leaf, 0));
+	}
+
+	free_node(btree, btree->root);
+	btree->root = build_branch_levels(btree, nodes, first_keys, node_count, fill_factor);
+	btree->last_leaf = prev;
+	btree->entry_count = entry_count;
+	free_buffer(btree, buffer, buffer_size);
+	return true;
+}
+
+/*
+ * A list of nodes created while inserting a batch of entries.  Each node is to
+ * be placed in the parent branch after the child at the corresponding index
+ * in `after`.  Its arrays are allocated up front for as many nodes as the
+ * batch can create.
+ */
+struct Node_List {
+	struct Btree_Node **nodes;
+	size_t *after;
+	size_t count;
+	size_t capacity;
+};
+
+/*
+ * Appends a node to a node list
+ */
+static void
+append_node(struct Node_List *restrict list, struct Btree_Node *restrict node, size_t after)
+{
+	if (list->count == list->capacity)
+		die("Created more nodes while inserting a batch than were accounted for.");
+	list->nodes[list->count] = node;
+	list->after[list->count] = after;
+	list->count++;
+}
+
+/*
+ * Sorts an array of pointers to entries with a stable merge sort, using
+ * `buffer`, which has room for as many pointers
+ */
+static void
+sort_entries(const struct Btree *restrict btree, const void **restrict entries, const void **restrict buffer, size_t count)
+{
+	size_t i = 1;
+	while (i < count && compare_entries(btree, entries[i - 1], entries[i]) >= 0)
+		i++;
+	if (i >= count)
+		return;
+
+	const void **src = entries;
+	const void **dst = buffer;
+	for (size_t width = 1; width < count; width *= 2) {
+		for (size_t start = 0; start < count; start += 2 * width) {
+			size_t left = start;
+			size_t middle = start + width < count ? start + width : count;
+			size_t right = middle;
+			size_t end = middle + width < count ? middle + width : count;
+			for (size_t j = start; j < end; j++) {
+				if (left < middle && (right == end || compare_entries(btree, src[left], src[right]) >= 0))
+					dst[j] = src[left++];
+				else
+					dst[j] = src[right++];
+			}
+		}
+		const void **tmp = src;
+		src = dst;
+		dst = tmp;
+	}
+	if (src != entries)
+		memcpy(entries, src, count * sizeof(void *));
+}
+
+/*
+ * Scratch space for inserting a batch of entries, which is allocated before
+ * the btree is modified
+ */
+struct Batch {
+	/* Large enough to hold a full leaf and the whole batch */
+	uint8_t *buffer;
+	/* Large enough to hold a position for each entry in the batch */
+	size_t *positions;
+	/*
+	 * The list of nodes created at each depth, starting with the nodes to
+	 * place next to the root.  A batch only inserts into one branch at a
+	 * time at each depth, so the branch's list of new children can be the
+	 * one for the depth below it.
+	 */
+	struct Node_List *lists;
+	/*
+	 * Large enough to hold the children of a full branch along with as
+	 * many new nodes as the batch can create, and their keys
+	 */
+	struct Btree_Node **nodes;
+	uint8_t *keys;
+};
+
+/*
+ * Merges a sorted run of entries into a leaf.  Entries matching entries in the
+ * leaf are handled according to the btree's duplicate policy.  If the entries
+ * don't all fit, the merged entries are spread evenly over the leaf and as
+ * many new leaves as needed, which are linked in after the leaf and appended
+ * to `siblings` to be placed after the leaf's index (`after`) in its parent.
+ * Returns the number of entries inserted.
+ */
+static size_t
+leaf_insert_batch(const struct Btree *restrict btree, struct Btree_Node *restrict leaf, const void **restrict entries, size_t count, struct Batch *restrict batch, struct Node_List *restrict siblings, size_t after)
+{
+	/*
+	 * Find the position of each new entry with a binary search, dropping
+	 * the ones that match entries in the leaf
+	 */
+	size_t *positions = batch->positions;
+	size_t kept = 0;
+	for (size_t j = 0; j < count; j++) {
+		size_t index = leaf_search(btree, leaf, get_entry_key(btree, entries[j]), true);
+		void *match = find_duplicate(btree, leaf, index, entries[j]);
+		if (match != NULL) {
+			if (btree->duplicates == BTREE_DUPLICATES_OVERWRITE)
+				overwrite_entry(btree, match, entries[j]);
+			continue;
+		}
+		entries[kept] = entries[j];
+		positions[kept] = index;
+		kept++;
+	}
+	count = kept;
+	if (count == 0)
+		return 0;
+
+	size_t total = leaf->entry_count + count;
+	size_t total_load = get_leaf_load(btree, leaf);
+	for (size_t j = 0; j < count; j++)
+		total_load += get_entry_load(btree, entries[j]);
+	size_t leaf_count = 1;
+	if (total_load > get_leaf_capacity(btree))
+		leaf_count = get_node_count(total_load, get_leaf_fill_max(btree), 1.0);
+
+	/* With inline keys, the leaf's strings are rebuilt along with its entries */
+	if (btree->inline_keys)
+		evacuate_strings(btree, leaf, btree->scratch);
+
+	/*
+	 * If the entries fit in the leaf, merge them in place, starting at the
+	 * end.  Otherwise, merge them into the buffer first.  The leaf's
+	 * entries after each new entry are moved as a block.
+	 */
+	uint8_t *merged = leaf_count == 1 ? get_leaf_entry_ptr(btree, leaf, 0) : batch->buffer;
+	size_t i = leaf->entry_count;
+	for (size_t j = count; j > 0; j--) {
+		size_t low = positions[j - 1];
+		memmove(merged + (low + j) * btree->entry_size, get_leaf_entry_ptr(btree, leaf, low), (i - low) * btree->entry_size);
+		memcpy(merged + (low + j - 1) * btree->entry_size, entries[j - 1], btree->entry_size);
+		i = low;
+	}
+	if (merged != get_leaf_entry_ptr(btree, leaf, 0))
+		memcpy(merged, get_leaf_entry_ptr(btree, leaf, 0), i * btree->entry_size);
+	if (leaf_count == 1) {
+		leaf->entry_count = total;
+		if (btree->inline_keys)
+			adopt_strings(btree, leaf);
+		if (btree->normalize != NULL)
+			normalize_entries(btree, leaf, 0, total);
+		return count;
+	}
+
+	struct Btree_Node *prev = leaf;
+	size_t merged_count = total;
+	size_t load = 0;
+	for (size_t k = 0; k < leaf_count; k++) {
+		size_t size = take_leaf_share(btree, merged, merged_count, &load, total_load, k, leaf_count);
+		struct Btree_Node *target = leaf;
+		if (k > 0) {
+			target = create_leaf(btree, 0);
+			target->prev = prev;
+			target->next = prev->next;
+			if (prev->next != NULL)
+				prev->next->prev = target;
+			prev->next = target;
+			prev = target;
+			append_node(siblings, target, after);
+		}
+		memcpy(get_leaf_entry_ptr(btree, target, 0), merged, size * btree->entry_size);
+		target->entry_count = size;
+		if (btree->inline_keys)
+			adopt_strings(btree, target);
+		if (btree->normalize != NULL)
+			normalize_entries(btree, target, 0, size);
+		merged += size * btree->entry_size;
+		merged_count -= size;
+	}
+	return count;
+}
+
+/*
+ * Places the nodes in `children`, created while inserting a batch into the
+ * children of a branch, in the branch.  If they don't all fit, the children
+ * are spread evenly over the branch and as many new branches as needed, which
+ * are appended to `siblings` to be placed after the branch's index (`after`)
+ * in its parent.
+ */
+static void
+branch_add_batch_children(const struct Btree *restrict btree, struct Btree_Node *restrict branch, const struct Node_List *restrict children, struct Batch *restrict batch, struct Node_List *restrict siblings, size_t after)
+{
+	size_t total = branch->child_count + children->count;
+	struct Btree_Node **nodes = batch->nodes;
+	uint8_t *keys = batch->keys;
+
+	size_t k = 0;
+	size_t n = 0;
+	for (size_t i = 0; i < branch->child_count; i++) {
+		nodes[k] = *get_branch_child_ptr_ptr(btree, branch, i);
+		if (i > 0)
+			memcpy(keys + k * btree->key_size, get_branch_key_ptr(btree, branch, i), btree->key_size);
+		k++;
+		for (; n < children->count && children->after[n] == i; n++) {
+			nodes[k] = children->nodes[n];
+			store_key(btree, keys + k * btree->key_size, nodes[k - 1], get_first_key_ptr(btree, nodes[k]));
+			k++;
+		}
+	}
+
+	size_t branch_count = get_node_count(total, btree->branch_child_count_max, 1.0);
+	k = 0;
+	for (size_t i = 0; i < branch_count; i++) {
+		size_t size = total / branch_count + (i < total % branch_count);
+		struct Btree_Node *target = branch;
+		if (i > 0) {
+			target = create_branch(btree, 0, 0);
+			append_node(siblings, target, after);
+		}
+		target->child_count = size;
+		for (size_t j = 0; j < size; j++) {
+			*get_branch_child_ptr_ptr(btree, target, j) = nodes[k + j];
+			if (j > 0)
+				memcpy(get_branch_key_ptr(btree, target, j), keys + (k + j) * btree->key_size, btree->key_size);
+		}
+		recount_branch(btree, target);
+		k += size;
+	}
+}
+
+/*
+ * Inserts a sorted run of entries into a subtree.  The run is divided among
+ * the children of each branch, so that every node is visited at most once.
+ * Nodes that overflow are split into as many nodes as needed, and the new
+ * nodes are appended to the list of the node's `depth` in `batch`, to be
+ * placed after the node's index (`after`) in its parent.  Returns the number
+ * of entries inserted.
+ */
+static size_t
+node_insert_batch(const struct Btree *restrict btree, struct Btree_Node *restrict node, const void **restrict entries, size_t count, struct Batch *restrict batch, size_t depth, size_t after)
+{
+	struct Node_List *siblings = &batch->lists[depth];
+	if (node->child_count == 0)
+		return leaf_insert_batch(btree, node, entries, count, batch, siblings, after);
+
+	struct Node_List *children = &batch->lists[depth + 1];
+	children->count = 0;
+	size_t *counts = get_branch_counts(btree, node);
+	bool per_child = btree->counts == BTREE_COUNTS_PER_CHILD;
+	size_t updated = 0;
+	size_t added = 0;
+	size_t i = 0;
+	while (i < count) {
+		size_t child_index = branch_search(btree, node, get_entry_key(btree, entries[i]), true);
+
+		/*
+		 * The child's run ends at the first entry that doesn't come
+		 * before the next key
+		 */
+		size_t end = count;
+		if (child_index + 1 < node->child_count) {
+			size_t low = i + 1;
+			while (low != end) {
+				size_t middle = (low + end) / 2;
+				const void *key = get_entry_key(btree, entries[middle]);
+				if (compare_branch_key(btree, node, child_index + 1, key, normalize_key(btree, key)) < 0)
+					low = middle + 1;
+				else
+					end = middle;
+			}
+		}
+
+		/* Apply the entries added so far to the cumulative counts up to this child */
+		for (; !per_child && updated < child_index; updated++)
+			counts[updated] += added;
+
+		size_t child_added = node_insert_batch(btree, *get_branch_child_ptr_ptr(btree, node, child_index), entries + i, end - i, batch, depth + 1, child_index);
+		if (per_child && child_index < node->child_count - 1)
+			counts[child_index] += child_added;
+		added += child_added;
+		i = end;
+	}
+	for (; !per_child && updated < node->child_count - 1; updated++)
+		counts[updated] += added;
+	node->entry_count += added;
+
+	if (children->count > 0)
+		branch_add_batch_children(btree, node, children, batch, siblings, after);
+	return added;
+}
+
+/*
+ * Returns the most leaves that inserting a batch of `entry_count`-many entries
+ * can create.  Every new leaf holds at least half as many entries as a full
+ * one, unless keys are inline, and takes at least one entry of the batch.
+ */
+static size_t
+get_batch_leaf_count(const struct Btree *btree, size_t entry_count)
+{
+	size_t leaf_count = (btree->entry_count + entry_count) / (btree->leaf_entry_count_max / 2) + 1;
+	if (leaf_count > entry_count || btree->inline_keys)
+		leaf_count = entry_count;
+	return leaf_count;
+}
+
+/*
+ * Reserves enough nodes to insert a batch of `entry_count`-many entries.  Each
+ * level of branches gets at most as many new nodes as the level below it.
+ */
+static bool
+reserve_batch(const struct Btree *btree, size_t entry_count)
+{
+	size_t leaf_count = get_batch_leaf_count(btree, entry_count);
+
+	/* The levels above the root are built like a bulk load */
+	size_t branch_count = leaf_count * get_height(btree);
+	for (size_t count = leaf_count + 1; count > 1; ) {
+		count = get_node_count(count, btree->branch_child_count_max, 1.0);
+		branch_count += count;
+	}
+	return reserve_nodes(btree, leaf_count, branch_count);
+}
+
+/*
+ * Inserts an array of `entry_count`-many entries into a btree.  The entries
+ * are sorted first, so that runs of them going to the same node share a
+ * single descent, and each leaf is visited at most once.  Duplicates are
+ * handled as if the entries were inserted one at a time in array order: unless
+ * the btree allows duplicates, the first of several matching entries in the
+ * batch is kept if the btree rejects duplicates, and the last is kept if it
+ * overwrites them.  Returns the number of entries inserted, not counting ones
+ * that overwrote or were rejected by entries in the btree, or `SIZE_MAX`,
+ * leaving the btree unchanged, if the allocator of the btree fails.
+ */
+size_t
+btree_insert_batch(struct Btree *restrict btree, const void *restrict entries, size_t entry_count)
+{
+	require_compare(btree);
+	if (entry_count == 0)
+		return 0;
+	if (pool_can_fail(btree->pool) && !reserve_batch(btree, entry_count))
+		return SIZE_MAX;
+
+	/*
+	 * Everything the batch needs is allocated at once, so that nothing is
+	 * left to fail once the btree is being modified.  There is a list of
+	 * new nodes for each depth down to the leaves.
+	 */
+	size_t leaf_count = get_batch_leaf_count(btree, entry_count);
+	size_t list_count = get_height(btree) + 1;
+	size_t node_count = btree->branch_child_count_max + leaf_count;
+	size_t buffer_size = 0;
+	size_t sorted_offset = lay_out(&buffer_size, entry_count * sizeof(void *));
+	size_t sort_buffer_offset = lay_out(&buffer_size, entry_count * sizeof(void *));
+	size_t entries_offset = lay_out(&buffer_size, (btree->leaf_entry_count_max + entry_count) * btree->entry_size);
+	size_t positions_offset = lay_out(&buffer_size, entry_count * sizeof(size_t));
+	size_t lists_offset = lay_out(&buffer_size, list_count * sizeof(struct Node_List));
+	size_t list_nodes_offset = lay_out(&buffer_size, list_count * leaf_count * sizeof(struct Btree_Node *));
+	size_t list_after_offset = lay_out(&buffer_size, list_count * leaf_count * sizeof(size_t));
+	size_t nodes_offset = lay_out(&buffer_size, node_count * sizeof(struct Btree_Node *));
+	size_t keys_offset = lay_out(&buffer_size, node_count * btree->key_size);
+	size_t first_keys_offset = lay_out(&buffer_size, (leaf_count + 1) * sizeof(void *));
+	uint8_t *buffer = alloc_buffer(btree, buffer_size);
+	if (buffer == NULL)
+		return SIZE_MAX;
+
+	struct Batch batch = {
+		.buffer = buffer + entries_offset,
+		.positions = (size_t *) (buffer + positions_offset),
+		.lists = (struct Node_List *) (buffer + lists_offset),
+		.nodes = (struct Btree_Node **) (buffer + nodes_offset),
+		.keys = buffer + keys_offset,
+	};
+	for (size_t i = 0; i < list_count; i++) {
+		batch.lists[i] = (struct Node_List) {
+			.nodes = (struct Btree_Node **) (buffer + list_nodes_offset) + i * leaf_count,
+			.after = (size_t *) (buffer + list_after_offset) + i * leaf_count,
+			.count = 0,
+			.capacity = leaf_count,
+		};
+	}
+
+	const void **sorted = (const void **) (buffer + sorted_offset);
+	for (size_t i = 0; i < entry_count; i++) {
+		sorted[i] = (const uint8_t *) entries + i * btree->entry_size;
+		require_entry_fits(btree, sorted[i]);
+	}
+	sort_entries(btree, sorted, (const void **) (buffer + sort_buffer_offset), entry_count);
+	if (btree->duplicates != BTREE_DUPLICATES_ALLOW) {
+		/* The sort is stable, so matching entries are in array order */
+		size_t kept = 0;
+		for (size_t i = 0; i < entry_count; i++) {
+			if (kept > 0 && compare_entries(btree, sorted[kept - 1], sorted[i]) == 0) {
+				if (btree->duplicates == BTREE_DUPLICATES_OVERWRITE)
+					sorted[kept - 1] = sorted[i];
+				continue;
+			}
+			sorted[kept++] = sorted[i];
+		}
+		entry_count = kept;
+	}
+
+	size_t inserted = node_insert_batch(btree, btree->root, sorted, entry_count, &batch, 0, 0);
+	const struct Node_List *siblings = &batch.lists[0];
+	if (siblings->count > 0) {
+		/* The root was split, so build new levels on top of it */
+		size_t root_count = siblings->count + 1;
+		struct Btree_Node **nodes = batch.nodes;
+		const void **first_keys = (const void **) (buffer + first_keys_offset);
+		for (size_t i = 0; i < root_count; i++) {
+			nodes[i] = i == 0 ? btree->root : siblings->nodes[i - 1];
+			first_keys[i] = get_first_key_ptr(btree, nodes[i]);
+		}
+		btree->root = build_branch_levels(btree, nodes, first_keys, root_count, 1.0);
+	}
+	while (btree->last_leaf->next != NULL)
+		btree->last_leaf = btree->last_leaf->next;
+	btree->entry_count += inserted;
+
+	free_buffer(btree, buffer, buffer_size);
+	return inserted;
+}
+
+/*
+ * Returns a pointer to the entry at a given index (`entry_index`) within a
+ * subtree.  `*count` is set to the number of entries that can be read from the
+ * returned pointer (as an array) and will be at least 1.
+ */
+static const void *
+node_fetch(const struct Btree *restrict btree, const struct Btree_Node *restrict node, size_t entry_index, size_t *restrict count)
+{
+	while (node->child_count != 0) {
+		if (btree->counts == BTREE_COUNTS_PER_CHILD) {
+			node = get_child(btree, node, find_child_by_index(btree, node, &entry_index));
+			continue;
+		}
+
+		size_t *cumulative_sizes = get_branch_counts(btree, node);
+		size_t low_index = 0;
+		size_t high_index = node->child_count - 1;
+		while (low_index != high_index) {
+			size_t middle_index = (low_index + high_index) / 2;
+			if (cumulative_sizes[middle_index] > entry_index) {
+				high_index = middle_index;
+			} else if (cumulative_sizes[middle_index] == entry_index) {
+				/*
+				 * The entry is the first one of the next
+				 * child, so the rest of the descent follows
+				 * first children without searching
+				 */
+				node = get_child(btree, node, middle_index + 1);
+				while (node->child_count > 0)
+					node = get_child(btree, node, 0);
+				*count = node->entry_count;
+				return get_leaf_entry_ptr(btree, node, 0);
+			} else {
+				low_index = middle_index + 1;
+			}
+		}
+		if (low_index > 0)
+			entry_index -= cumulative_sizes[low_index - 1];
+		node = get_child(btree, node, low_index);
+	}
+
+	*count = node->entry_count - entry_index;
+	return get_leaf_entry_ptr(btree, node, entry_index);
+}
+
+/*
+ * Retrieves an entry at a specific index.  Returns a pointer to the requested
+ * entry.  `*count` is set to the number of entries that can be read from the
+ * returned pointer, including the requested entry, as an array, and will be at
+ * least 1.  Make sure the function is called with a valid index.
+ */
+const void *
+btree_fetch(const struct Btree *restrict btree, size_t entry_index, size_t *restrict count)
+{
+	return node_fetch(btree, btree->root, entry_index, count);
+}
+
+/*
+ * Descends from the root to the leaf containing the entry at `*entry_index`.
+ * Returns the leaf, and sets `*entry_index` to the index of the entry within
+ * the leaf.
+ */
+static const struct Btree_Node *
+find_leaf_by_index(const struct Btree *restrict btree, size_t *restrict entry_index)
+{
+	const struct Btree_Node *node = btree->root;
+	while (node->child_count != 0)
+		node = get_child(btree, node, find_child_by_index(btree, node, entry_index));
+	return node;
+}
+
+/*
+ * Returns the index of the child of a branch to descend into to find the first
+ * entry that does not come before `key`, or, if `upper` is true, the first
+ * entry that comes after `key`
+ */
+static size_t
+find_child_by_key(const struct Btree *restrict btree, const struct Btree_Node *restrict branch, const void *restrict key, bool upper)
+{
+	/*
+	 * Unless the btree allows duplicates, no entry before a key matches
+	 * it, so the descent can stop at children whose keys match `key`.
+	 * Otherwise, matching entries can be on either side of a matching key.
+	 */
+	return branch_search(btree, branch, key, upper || btree->duplicates != BTREE_DUPLICATES_ALLOW);
+}
+
+/*
+ * Returns the number of entries in a subtree that come before `key`, or, if
+ * `upper` is true, that do not come after `key`.  Only the counts along the
+ * path to a single leaf are read.
+ */
+static size_t
+node_rank(const struct Btree *restrict btree, const struct Btree_Node *restrict node, const void *restrict key, bool upper)
+{
+	size_t rank = 0;
+	while (node->child_count != 0) {
+		size_t child_index = find_child_by_key(btree, node, key, upper);
+		const struct Btree_Node *child = get_child(btree, node, child_index);
+		rank += get_child_offset(btree, node, child_index);
+		node = child;
+	}
+	return rank + leaf_search(btree, node, key, upper);
+}
+
+/*
+ * Descends from the root to the leaf that would contain `key`, and finds the
+ * position of the first entry that does not come before `key`, or, if `upper`
+ * is true, of the first entry that comes after `key`.  `*leaf` and
+ * `*entry_index` are set to that position, which is past the end of the last
+ * leaf if there is no such entry.  Returns the rank of the position.
+ */
+static size_t
+locate(const struct Btree *restrict btree, const void *restrict key, bool upper, const struct Btree_Node *restrict *restrict leaf, size_t *restrict entry_index)
+{
+	require_compare(btree);
+	const struct Btree_Node *node = btree->root;
+	size_t rank = 0;
+	while (node->child_count != 0) {
+		size_t child_index = find_child_by_key(btree, node, key, upper);
+		const struct Btree_Node *child = get_child(btree, node, child_index);
+		rank += get_child_offset(btree, node, child_index);
+		node = child;
+	}
+
+	*entry_index = leaf_search(btree, node, key, upper);
+	rank += *entry_index;
+
+	/*
+	 * If the position is past the end of the leaf, the entry (if there is
+	 * one) is the first entry of the next leaf
+	 */
+	if (*entry_index == node->entry_count && node->next != NULL) {
+		node = node->next;
+		*entry_index = 0;
+	}
+	*leaf = node;
+	return rank;
+}
+
+/*
+ * Returns a pointer to the entry at a position in a leaf, or NULL if the
+ * position is past the end of the leaf.  `*count` is set to the number of
+ * entries that can be read from the returned pointer as an array (0 if NULL is
+ * returned).
+ */
+static const void *
+get_position_entry_ptr(const struct Btree *restrict btree, const struct Btree_Node *restrict leaf, size_t entry_index, size_t *restrict count)
+{
+	*count = leaf->entry_count - entry_index;
+	if (*count == 0)
+		return NULL;
+	return get_leaf_entry_ptr(btree, leaf, entry_index);
+}
+
+/*
+ * Looks up the entry matching `key`, or the first of them if the btree allows
+ * duplicates.  Returns a pointer to the entry, or NULL if there is no such
+ * entry.  `*index` is set to the index of the entry, or to the index it would
+ * be inserted at if it is not in the btree.  `*count` is set to the number of
+ * entries that can be read from the returned pointer, including the requested
+ * entry, as an array (0 if NULL is returned).
+ */
+const void *
+btree_find(const struct Btree *restrict btree, const void *restrict key, size_t *restrict index, size_t *restrict count)
+{
+	const struct Btree_Node *leaf;
+	size_t entry_index;
+	*index = locate(btree, key, false, &leaf, &entry_index);
+	const void *entry = get_position_entry_ptr(btree, leaf, entry_index, count);
+	if (entry == NULL || compare(btree, get_entry_key(btree, entry), key) != 0) {
+		*count = 0;
+		return NULL;
+	}
+	return entry;
+}
+
+/*
+ * Returns a pointer to the first entry that does not come before `key`, or
+ * NULL if there is no such entry.  `*index` and `*count` are set the same way
+ * as in `btree_find`.
+ */
+const void *
+btree_lower_bound(const struct Btree *restrict btree, const void *restrict key, size_t *restrict index, size_t *restrict count)
+{
+	const struct Btree_Node *leaf;
+	size_t entry_index;
+	*index = locate(btree, key, false, &leaf, &entry_index);
+	return get_position_entry_ptr(btree, leaf, entry_index, count);
+}
+
+/*
+ * Returns a pointer to the first entry that comes after `key`, or NULL if
+ * there is no such entry.  `*index` and `*count` are set the same way as in
+ * `btree_find`.
+ */
+const void *
+btree_upper_bound(const struct Btree *restrict btree, const void *restrict key, size_t *restrict index, size_t *restrict count)
+{
+	const struct Btree_Node *leaf;
+	size_t entry_index;
+	*index = locate(btree, key, true, &leaf, &entry_index);
+	return get_position_entry_ptr(btree, leaf, entry_index, count);
+}
+
+/*
+ * Returns the number of entries that come before `key`, which is the index of
+ * the first entry that does not come before it
+ */
+size_t
+btree_rank(const struct Btree *restrict btree, const void *restrict key)
+{
+	require_compare(btree);
+	return node_rank(btree, btree->root, key, false);
+}
+
+/*
+ * Returns the number of entries that do not come before `low` and come before
+ * `high`.  The two descents are shared until they reach different children of
+ * a branch, from which point each of them only counts entries within its own
+ * child.
+ */
+size_t
+btree_count_range(const struct Btree *restrict btree, const void *restrict low, const void *restrict high)
+{
+	require_compare(btree);
+	if (compare(btree, low, high) <= 0)
+		return 0;
+
+	const struct Btree_Node *node = btree->root;
+	while (node->child_count != 0) {
+		size_t low_index = find_child_by_key(btree, node, low, false);
+		size_t high_index = find_child_by_key(btree, node, high, false);
+		if (low_index != high_index) {
+			size_t count = get_child_offset(btree, node, high_index) - get_child_offset(btree, node, low_index);
+			const struct Btree_Node *low_child = get_child(btree, node, low_index);
+			const struct Btree_Node *high_child = get_child(btree, node, high_index);
+			return count - node_rank(btree, low_child, low, false) + node_rank(btree, high_child, high, false);
+		}
+		node = get_child(btree, node, low_index);
+	}
+	return leaf_search(btree, node, high, false) - leaf_search(btree, node, low, false);
+}
+
+/*
+ * Returns the leaf at the start (if `last` is false) or the end (if `last` is
+ * true) of a btree, by following the first or last child of each branch
+ */
+static struct Btree_Node *
+get_edge_leaf(const struct Btree *restrict btree, bool last)
+{
+	struct Btree_Node *node = btree->root;
+	while (node->child_count != 0)
+		node = *get_branch_child_ptr_ptr(btree, node, last ? node->child_count - 1 : 0);
+	return node;
+}
+
+/*
+ * Positions a cursor at the first entry of a btree.  Returns a pointer to the
+ * entry, or NULL if the btree is empty.
+ */
+const void *
+btree_cursor_first(struct Btree_Cursor *restrict cursor, const struct Btree *restrict btree)
+{
+	cursor->btree = btree;
+	cursor->leaf = get_edge_leaf(btree, false);
+	cursor->entry_index = 0;
+	cursor->index = 0;
+	return btree_cursor_get(cursor);
+}
+
+/*
+ * Positions a cursor at the last entry of a btree.  Returns a pointer to the
+ * entry, or NULL if the btree is empty.
+ */
+const void *
+btree_cursor_last(struct Btree_Cursor *restrict cursor, const struct Btree *restrict btree)
+{
+	cursor->btree = btree;
+	cursor->leaf = btree->last_leaf;
+	cursor->entry_index = cursor->leaf->entry_count;
+	cursor->index = btree->entry_count;
+	return btree_cursor_prev(cursor);
+}
+
+/*
+ * Positions a cursor at the first entry that does not come before `key`.
+ * Returns a pointer to the entry, or NULL if there is no such entry, in which
+ * case the cursor is positioned at the end of the btree.
+ */
+const void *
+btree_cursor_seek(struct Btree_Cursor *restrict cursor, const struct Btree *restrict btree, const void *restrict key)
+{
+	cursor->btree = btree;
+	cursor->index = locate(btree, key, false, &cursor->leaf, &cursor->entry_index);
+	return btree_cursor_get(cursor);
+}
+
+/*
+ * Positions a cursor at the entry at a specific index.  Returns a pointer to
+ * the entry, or NULL if the index is the entry count of the btree, in which
+ * case the cursor is positioned at the end of the btree.
+ */
+const void *
+btree_cursor_seek_index(struct Btree_Cursor *restrict cursor, const struct Btree *restrict btree, size_t entry_index)
+{
+	cursor->btree = btree;
+	cursor->index = entry_index;
+	if (entry_index == btree->entry_count) {
+		cursor->leaf = btree->last_leaf;
+		cursor->entry_index = cursor->leaf->entry_count;
+	} else {
+		cursor->leaf = find_leaf_by_index(btree, &entry_index);
+		cursor->entry_index = entry_index;
+	}
+	return btree_cursor_get(cursor);
+}
+
+/*
+ * Returns a pointer to the entry that a cursor is positioned at, or NULL if the
+ * cursor is at the end of the btree
+ */
+const void *
+btree_cursor_get(const struct Btree_Cursor *cursor)
+{
+	if (cursor->entry_index == cursor->leaf->entry_count)
+		return NULL;
+	return get_leaf_entry_ptr(cursor->btree, cursor->leaf, cursor->entry_index);
+}
+
+/*
+ * Returns the index of the entry that a cursor is positioned at, or the entry
+ * count of the btree if the cursor is at the end of the btree
+ */
+size_t
+btree_cursor_index(const struct Btree_Cursor *cursor)
+{
+	return cursor->index;
+}
+
+/*
+ * Moves a cursor to the next entry.  Returns a pointer to the entry, or NULL if
+ * the cursor was at the last entry, in which case the cursor is positioned at
+ * the end of the btree.  The cursor MUST NOT already be at the end.
+ */
+const void *
+btree_cursor_next(struct Btree_Cursor *cursor)
+{
+	cursor->entry_index++;
+	cursor->index++;
+	if (cursor->entry_index == cursor->leaf->entry_count && cursor->leaf->next != NULL) {
+		cursor->leaf = cursor->leaf->next;
+		cursor->entry_index = 0;
+		if (cursor->leaf->next != NULL)
+			prefetch_node(cursor->btree, cursor->leaf->next);
+	}
+	return btree_cursor_get(cursor);
+}
+
+/*
+ * Moves a cursor to the previous entry.  Returns a pointer to the entry, or
+ * NULL if the cursor was at the first entry, in which case the cursor is
+ * positioned at the end of the btree.  Moving a cursor that is at the end of
+ * the btree moves it to the last entry.
+ */
+const void *
+btree_cursor_prev(struct Btree_Cursor *cursor)
+{
+	while (cursor->entry_index == 0) {
+		if (cursor->leaf->prev == NULL) {
+			cursor->leaf = cursor->btree->last_leaf;
+			cursor->entry_index = cursor->leaf->entry_count;
+			cursor->index = cursor->btree->entry_count;
+			return NULL;
+		}
+		cursor->leaf = cursor->leaf->prev;
+		cursor->entry_index = cursor->leaf->entry_count;
+		if (cursor->leaf->prev != NULL)
+			prefetch_node(cursor->btree, cursor->leaf->prev);
+	}
+	cursor->entry_index--;
+	cursor->index--;
+	return btree_cursor_get(cursor);
+}
+
+/*
+ * Returns true if a node holds fewer entries (for leaves) or children (for
+ * branches) than a node created by splitting a full node, meaning that it
+ * should be merged with or borrow from a sibling
+ */
+static bool
+node_is_underfull(const struct Btree *restrict btree, const struct Btree_Node *restrict node)
+{
+	if (node->child_count == 0)
+		return get_leaf_load(btree, node) < get_leaf_capacity(btree) / 2;
+	return node->child_count < btree->branch_child_count_max / 2;
+}
+
+/*
+ * Removes a child from a branch.  The child's entries must either have been
+ * moved into the preceding child or there must be none of them, since the
+ * counts array is only shifted.  Cumulative counts are shifted onto the
+ * preceding child, and the caller must set its count if counts are per child.
+ */
+static void
+branch_erase(const struct Btree *restrict btree, struct Btree_Node *restrict branch, size_t child_index)
+{
+	if (branch->child_count > 1) {
+		size_t *counts = get_branch_counts(btree, branch);
+		size_t size_index = child_index;
+		if (btree->counts == BTREE_COUNTS_CUMULATIVE && child_index > 0)
+			size_index--;
+		if (size_index < branch->child_count - 1)
+			memmove(&counts[size_index], &counts[size_index + 1], (branch->child_count - 2 - size_index) * sizeof(size_t));
+	}
+	move_branch_children(btree, branch, child_index, branch, child_index + 1, branch->child_count - child_index - 1);
+	branch->child_count--;
+}
+
+/*
+ * Merges the children of a branch at `left_index` and `left_index + 1` into
+ * the first of them and frees the second.  The two children must fit in a
+ * single node.
+ */
+static void
+merge_children(const struct Btree *restrict btree, struct Btree_Node *restrict branch, size_t left_index)
+{
+	struct Btree_Node *left = *get_branch_child_ptr_ptr(btree, branch, left_index);
+	struct Btree_Node *right = *get_branch_child_ptr_ptr(btree, branch, left_index + 1);
+
+	if (left->child_count == 0) {
+		if (btree->inline_keys)
+			evacuate_strings(btree, left, btree->scratch);
+		move_leaf_entries(btree, left, left->entry_count, right, 0, right->entry_count);
+		left->entry_count += right->entry_count;
+		if (btree->inline_keys)
+			adopt_strings(btree, left);
+		left->next = right->next;
+		if (right->next != NULL)
+			right->next->prev = left;
+	} else {
+		/*
+		 * The key between the two children in the parent becomes
+		 * the key in front of the right child's first child
+		 */
+		size_t left_child_count = left->child_count;
+		move_branch_children(btree, left, left_child_count, right, 0, right->child_count);
+		left->child_count += right->child_count;
+		if (left_child_count > 0 && right->child_count > 0)
+			memcpy(get_branch_key_ptr(btree, left, left_child_count), get_branch_key_ptr(btree, branch, left_index + 1), btree->key_size);
+		recount_branch(btree, left);
+	}
+
+	branch_erase(btree, branch, left_index + 1);
+	set_child_entry_count(btree, branch, left_index, left->entry_count);
+	if (left->child_count == 0)
+		free_leaf(btree, right);
+	else
+		free_branch(btree, right);
+}
+
+/*
+ * Evens out the number of entries (for leaves) or children (for branches) of
+ * the children of a branch at `left_index` and `left_index + 1` by moving some
+ * of them from one child to the other
+ */
+static void
+redistribute_children(const struct Btree *restrict btree, struct Btree_Node *restrict branch, size_t left_index)
+{
+	struct Btree_Node *left = *get_branch_child_ptr_ptr(btree, branch, left_index);
+	struct Btree_Node *right = *get_branch_child_ptr_ptr(btree, branch, left_index + 1);
+	void *separator = get_branch_key_ptr(btree, branch, left_index + 1);
+
+	if (left->child_count == 0) {
+		size_t left_count = get_balanced_index(btree, left, right);
+		if (btree->inline_keys) {
+			evacuate_strings(btree, left, btree->scratch);
+			evacuate_strings(btree, right, btree->scratch + btree->leaf_bytes);
+		}
+		if (left->entry_count < left_count) {
+			size_t moved = left_count - left->entry_count;
+			move_leaf_entries(btree, left, left->entry_count, right, 0, moved);
+			move_leaf_entries(btree, right, 0, right, moved, right->entry_count - moved);
+			left->entry_count += moved;
+			right->entry_count -= moved;
+		} else {
+			size_t moved = left->entry_count - left_count;
+			move_leaf_entries(btree, right, moved, right, 0, right->entry_count);
+			move_leaf_entries(btree, right, 0, left, left_count, moved);
+			left->entry_count -= moved;
+			right->entry_count += moved;
+		}
+		if (btree->inline_keys) {
+			adopt_strings(btree, left);
+			adopt_strings(btree, right);
+		}
+		store_key(btree, separator, left, get_entry_key(btree, get_leaf_entry_ptr(btree, right, 0)));
+	} else {
+		/*
+		 * Children are rotated through the parent: the separator in
+		 * the parent moves down in front of the old first child of the
+		 * right node, and the key in front of the new first child of
+		 * the right node moves up to become the new separator.
+		 */
+		size_t left_count = (left->child_count + right->child_count) / 2;
+		if (left->child_count < left_count) {
+			size_t moved = left_count - left->child_count;
+			move_branch_children(btree, left, left->child_count, right, 0, moved);
+			memcpy(get_branch_key_ptr(btree, left, left->child_count), separator, btree->key_size);
+			memcpy(separator, get_branch_key_ptr(btree, right, moved), btree->key_size);
+			move_branch_children(btree, right, 0, right, moved, right->child_count - moved);
+			left->child_count += moved;
+			right->child_count -= moved;
+		} else {
+			size_t moved = left->child_count - left_count;
+			move_branch_children(btree, right, moved, right, 0, right->child_count);
+			memcpy(get_branch_key_ptr(btree, right, moved), separator, btree->key_size);
+			move_branch_children(btree, right, 0, left, left_count, moved);
+			memcpy(separator, get_branch_key_ptr(btree, left, left_count), btree->key_size);
+			left->child_count -= moved;
+			right->child_count += moved;
+		}
+		recount_branch(btree, left);
+		recount_branch(btree, right);
+	}
+
+	set_child_entry_count(btree, branch, left_index, left->entry_count);
+	set_child_entry_count(btree, branch, left_index + 1, right->entry_count);
+}
+
+/*
+ * Restores the minimum size of the child of a branch at `child_index` by
+ * merging it with a sibling, or, if the two would not fit in a single node,
+ * by borrowing from the sibling.  A child without siblings is left as is.
+ */
+static void
+rebalance_child(const struct Btree *restrict btree, struct Btree_Node *restrict branch, size_t child_index)
+{
+	if (branch->child_count < 2)
+		return;
+
+	size_t left_index = child_index > 0 ? child_index - 1 : 0;
+	const struct Btree_Node *left = *get_branch_child_ptr_ptr(btree, branch, left_index);
+	const struct Btree_Node *right = *get_branch_child_ptr_ptr(btree, branch, left_index + 1);
+	bool fits = left->child_count == 0 ?
+		get_leaf_load(btree, left) + get_leaf_load(btree, right) <= get_leaf_capacity(btree) :
+		left->child_count + right->child_count <= btree->branch_child_count_max;
+	if (fits)
+		merge_children(btree, branch, left_index);
+	else
+		redistribute_children(btree, branch, left_index);
+}
+
+/*
+ * Frees a branch with a single child and returns the child, which takes its
+ * place
+ */
+static struct Btree_Node *
+collapse_root(const struct Btree *restrict btree, struct Btree_Node *restrict root)
+{
+	struct Btree_Node *child = *get_branch_child_ptr_ptr(btree, root, 0);
+	free_branch(btree, root);
+	return child;
+}
+
+/*
+ * Removes the entry at `entry_index` within a subtree, copying it to
+ * `removed` unless `removed` is NULL.  The entry counts of the branches on the
+ * path to the entry are updated on the way back up, and children that become
+ * too small are rebalanced, but the node itself is left for the caller to
+ * rebalance.
+ */
+static void
+node_remove(const struct Btree *restrict btree, struct Btree_Node *restrict node, size_t entry_index, void *restrict removed)
+{
+	struct Path path;
+	path.length = 0;
+	while (node->child_count != 0) {
+		size_t child_index = find_child_by_index(btree, node, &entry_index);
+		path_push(&path, node, child_index);
+		node = get_child(btree, node, child_index);
+	}
+
+	const void *entry = get_leaf_entry_ptr(btree, node, entry_index);
+	if (removed != NULL)
+		memcpy(removed, entry, btree->entry_size);
+	if (btree->inline_keys)
+		get_leaf_heap(btree, node)->used -= strlen(get_entry_string(btree, entry)) + 1;
+	move_leaf_entries(btree, node, entry_index, node, entry_index + 1, node->entry_count - entry_index - 1);
+	node->entry_count--;
+
+	while (path.length > 0) {
+		path.length--;
+		struct Btree_Node *branch = path.branches[path.length];
+		size_t child_index = path.child_indices[path.length];
+		change_child_entry_count(btree, branch, child_index, -1);
+		branch->entry_count--;
+		if (node_is_underfull(btree, node))
+			rebalance_child(btree, branch, child_index);
+		node = branch;
+	}
+}
+
+/*
+ * Removes the entry at a specific index, copying it to `removed` unless
+ * `removed` is NULL.  Make sure the function is called with a valid index.
+ */
+void
+btree_remove_at(struct Btree *restrict btree, size_t entry_index, void *restrict removed)
+{
+	node_remove(btree, btree->root, entry_index, removed);
+	btree->entry_count--;
+
+	/* Collapse roots that are left with a single child */
+	while (btree->root->child_count == 1)
+		btree->root = collapse_root(btree, btree->root);
+
+	/* The last leaf may have been merged into the one before it */
+	btree->last_leaf = get_edge_leaf(btree, true);
+}
+
+/*
+ * Removes the entry matching `key`, or the first of them if the btree allows
+ * duplicates, copying it to `removed` unless `removed` is NULL.  Returns true
+ * if an entry was removed, or false if there was no matching entry.
+ */
+bool
+btree_remove(struct Btree *restrict btree, const void *restrict key, void *restrict removed)
+{
+	size_t entry_index, count;
+	if (btree_find(btree, key, &entry_index, &count) == NULL)
+		return false;
+	btree_remove_at(btree, entry_index, removed);
+	return true;
+}
+
+/*
+ * A subtree taken out of a btree, or built from parts of one, along with its
+ * height.  Leaves are at height 0.  `root` is NULL if the subtree is empty.
+ */
+struct Subtree {
+	struct Btree_Node *root;
+	size_t height;
+};
+
+/*
+ * Adds a child to a branch at `child_index`, with the key of the child's first
+ * entry as its key.  If the branch is full, it is split in half first, and the
+ * new branch holding the upper half is returned.  Otherwise NULL is returned.
+ * The entry counts of the branches are recomputed.
+ */
+static struct Btree_Node *
+branch_add_child(const struct Btree *restrict btree, struct Btree_Node *restrict branch, size_t child_index, struct Btree_Node *restrict child)
+{
+	struct Btree_Node *new_branch = NULL;
+	struct Btree_Node *target = branch;
+	if (branch->child_count == btree->branch_child_count_max) {
+		size_t middle_index = branch->child_count / 2;
+		new_branch = create_branch(btree, branch->child_count - middle_index, 0);
+		move_branch_children(btree, new_branch, 0, branch, middle_index, new_branch->child_count);
+		branch->child_count = middle_index;
+		if (child_index > middle_index) {
+			target = new_branch;
+			child_index -= middle_index;
+		}
+	}
+
+	move_branch_children(btree, target, child_index + 1, target, child_index, target->child_count - child_index);
+	*get_branch_child_ptr_ptr(btree, target, child_index) = child;
+	target->child_count++;
+	if (child_index > 0)
+		store_key(btree, get_branch_key_ptr(btree, target, child_index), *get_branch_child_ptr_ptr(btree, target, child_index - 1), get_first_key_ptr(btree, child));
+	else
+		store_key(btree, get_branch_key_ptr(btree, target, 1), child, get_first_key_ptr(btree, *get_branch_child_ptr_ptr(btree, target, 1)));
+
+	recount_branch(btree, branch);
+	if (new_branch != NULL)
+		recount_branch(btree, new_branch);
+	return new_branch;
+}
+
+/*
+ * Places the subtree `sub` at the end (if `last` is true) or the start (if
+ * `last` is false) of the subtree `node`, which must be taller than `sub`, so
+ * that the root of `sub` becomes a child of the node at height
+ * `sub_height + 1` on the right or left edge of `node`.  Nodes along the edge
+ * that overflow are split, and if `node` itself is split, the new node holding
+ * its upper half is returned.  Otherwise NULL is returned.
+ */
+static struct Btree_Node *
+node_join(const struct Btree *restrict btree, struct Btree_Node *restrict node, size_t height, struct Btree_Node *restrict sub, size_t sub_height, bool last)
+{
+	if (height == sub_height + 1)
+		return branch_add_child(btree, node, last ? node->child_count : 0, sub);
+
+	size_t child_index = last ? node->child_count - 1 : 0;
+	struct Btree_Node *new_child = node_join(btree, *get_branch_child_ptr_ptr(btree, node, child_index), height - 1, sub, sub_height, last);
+	if (new_child == NULL) {
+		recount_branch(btree, node);
+		return NULL;
+	}
+	return branch_add_child(btree, node, child_index + 1, new_child);
+}
+
+/*
+ * Joins two subtrees, where every entry of `left` goes before every entry of
+ * `right`, into one.  Only the nodes along the edge of the taller subtree
+ * down to the height of the shorter one are modified.  The leaves of the two
+ * subtrees must already be linked together.
+ */
+static struct Subtree
+join(const struct Btree *restrict btree, struct Subtree left, struct Subtree right)
+{
+	if (left.root == NULL)
+		return right;
+	if (right.root == NULL)
+		return left;
+
+	bool last = left.height >= right.height;
+	struct Subtree joined = last ? left : right;
+	size_t short_height = last ? right.height : left.height;
+	struct Btree_Node *new_node;
+	if (left.height == right.height)
+		new_node = right.root;
+	else if (last)
+		new_node = node_join(btree, left.root, left.height, right.root, right.height, true);
+	else
+		new_node = node_join(btree, right.root, right.height, left.root, left.height, false);
+
+	if (new_node != NULL) {
+		/* The root was split, so it gets a new parent */
+		struct Btree_Node *root = create_branch(btree, 1, 0);
+		*get_branch_child_ptr_ptr(btree, root, 0) = joined.root;
+		branch_add_child(btree, root, 1, new_node);
+		joined.root = root;
+		joined.height++;
+	}
+
+	/*
+	 * The shorter subtree's root, and, if the subtrees were the same
+	 * height, the other root, may be too small to be a child.  They are
+	 * at the edge of their parent, next to each other.
+	 */
+	struct Btree_Node *parent = joined.root;
+	for (size_t height = joined.height; height > short_height + 1; height--)
+		parent = *get_branch_child_ptr_ptr(btree, parent, last ? parent->child_count - 1 : 0);
+	size_t child_index = last ? parent->child_count - 1 : 0;
+	size_t sibling_index = last ? child_index - 1 : 1;
+	if (node_is_underfull(btree, *get_branch_child_ptr_ptr(btree, parent, child_index)) || node_is_underfull(btree, *get_branch_child_ptr_ptr(btree, parent, sibling_index)))
+		rebalance_child(btree, parent, child_index);
+
+	while (joined.root->child_count == 1) {
+		joined.root = collapse_root(btree, joined.root);
+		joined.height--;
+	}
+	return joined;
+}
+
+/*
+ * Returns the subtree made up of a branch, whose children have been cut down
+ * to a possibly empty part of them, at `height`.  A branch left without
+ * children is freed and a branch left with a single child is replaced by it.
+ */
+static struct Subtree
+get_branch_part(const struct Btree *restrict btree, struct Btree_Node *restrict branch, size_t height)
+{
+	if (branch->child_count == 0) {
+		free_branch(btree, branch);
+		return (struct Subtree) { NULL, 0 };
+	}
+	if (branch->child_count == 1)
+		return (struct Subtree) { collapse_root(btree, branch), height - 1 };
+	recount_branch(btree, branch);
+	return (struct Subtree) { branch, height };
+}
+
+/*
+ * Splits a subtree into the entries before `entry_index` (`*left`) and the
+ * rest (`*right`).  Each branch on the path to the entry is cut in two around
+ * the child containing it, and the pieces are joined back together on the way
+ * up.  The leaf containing the entry stays linked to the new leaf holding its
+ * upper half.
+ */
+static void
+node_split(const struct Btree *restrict btree, struct Subtree subtree, size_t entry_index, struct Subtree *restrict left, struct Subtree *restrict right)
+{
+	struct Btree_Node *node = subtree.root;
+	if (node->child_count == 0) {
+		*left = (struct Subtree) { node, 0 };
+		*right = (struct Subtree) { NULL, 0 };
+		if (entry_index == node->entry_count)
+			return;
+		if (entry_index == 0) {
+			*right = *left;
+			*left = (struct Subtree) { NULL, 0 };
+			return;
+		}
+
+		right->root = split_leaf(btree, node, entry_index);
+		return;
+	}
+
+	size_t child_index = find_child_by_index(btree, node, &entry_index);
+	struct Btree_Node *child = *get_branch_child_ptr_ptr(btree, node, child_index);
+	struct Subtree child_left, child_right;
+	node_split(btree, (struct Subtree) { child, subtree.height - 1 }, entry_index, &child_left, &child_right);
+
+	/* The children after the split child go to a new branch */
+	struct Btree_Node *new_branch = create_branch(btree, node->child_count - child_index - 1, 0);
+	move_branch_children(btree, new_branch, 0, node, child_index + 1, new_branch->child_count);
+	node->child_count = child_index;
+
+	*left = join(btree, get_branch_part(btree, node, subtree.height), child_left);
+	*right = join(btree, child_right, get_branch_part(btree, new_branch, subtree.height));
+}
+
+/*
+ * Makes a subtree the contents of a btree, detaching its leaves from any
+ * leaves outside of it
+ */
+static void
+set_contents(struct Btree *restrict btree, struct Subtree subtree, size_t entry_count)
+{
+	btree->root = subtree.root != NULL ? subtree.root : create_leaf(btree, 0);
+	btree->entry_count = entry_count;
+	get_edge_leaf(btree, false)->prev = NULL;
+	btree->last_leaf = get_edge_leaf(btree, true);
+	btree->last_leaf->next = NULL;
+}
+
+/*
+ * Splits a btree in two at `entry_index`.  The entries from that index onward
+ * are moved to a new btree, with the same parameters, which is returned.  Only
+ * the nodes on the path to the entry are rebuilt.  `entry_index` may be the
+ * entry count of the btree, in which case the new btree is empty.  Returns
+ * NULL, leaving the btree unchanged, if the allocator of the btree fails.
+ */
+struct Btree *
+btree_split_at(struct Btree *restrict btree, size_t entry_index)
+{
+	if (entry_index > btree->entry_count)
+		die("Attempted to split a btree at an index past its end.");
+
+	/*
+	 * Each level gets a new branch, and two joins, each of which may
+	 * split every level and add a root.  Either btree may be left empty
+	 * and get a new leaf.
+	 */
+	size_t height = get_height(btree);
+	struct Btree *right_btree = pool_alloc_object(btree->pool, sizeof(struct Btree));
+	uint8_t *scratch = btree->inline_keys ? alloc_buffer(btree, get_scratch_size(btree)) : NULL;
+	if (right_btree == NULL || (btree->inline_keys && scratch == NULL) || !reserve_nodes(btree, 3, height * (2 * height + 3))) {
+		if (right_btree != NULL)
+			pool_free_object(btree->pool, right_btree, sizeof(struct Btree));
+		free_buffer(btree, scratch, get_scratch_size(btree));
+		return NULL;
+	}
+	*right_btree = *btree;
+	right_btree->scratch = scratch;
+	right_btree->pool = pool_share(btree->pool);
+	struct Subtree left, right;
+	node_split(btree, (struct Subtree) { btree->root, height }, entry_index, &left, &right);
+	set_contents(right_btree, right, btree->entry_count - entry_index);
+	set_contents(btree, left, entry_index);
+	return right_btree;
+}
+
+/*
+ * Moves all of the entries of `b` to the end of `a`, leaving `b` empty.  Only
+ * the nodes along the edge of the taller btree down to the height of the other
+ * are rebuilt.  Returns false, leaving both btrees unchanged, unless the two
+ * btrees have the same parameters and every entry of `a` comes before every
+ * entry of `b` (or matches it, if duplicates are allowed), and the allocator
+ * of `a` doesn't fail.  Btrees in sequence mode can always be concatenated.
+ */
+bool
+btree_concat(struct Btree *restrict a, struct Btree *restrict b)
+{
+	if (a->branch_child_count_max != b->branch_child_count_max || a->leaf_entry_count_max != b->leaf_entry_count_max || a->entry_size != b->entry_size || a->inline_keys != b->inline_keys || a->key_size != b->key_size || a->key_offset != b->key_offset || a->compare != b->compare || a->normalize != b->normalize || a->compare_cb_data != b->compare_cb_data || a->duplicates != b->duplicates || a->counts != b->counts || !pool_is_compatible(a->pool, b->pool))
+		return false;
+	if (b->entry_count == 0)
+		return true;
+
+	struct Btree_Node *first_leaf = get_edge_leaf(b, false);
+	if (a->entry_count > 0 && a->compare != NULL) {
+		int comparison = compare_entries(a, get_leaf_entry_ptr(a, a->last_leaf, a->last_leaf->entry_count - 1), get_leaf_entry_ptr(b, first_leaf, 0));
+		if (comparison < 0 || (comparison == 0 && a->duplicates != BTREE_DUPLICATES_ALLOW))
+			return false;
+	}
+
+	/*
+	 * Joining may split every level of the taller btree and add a root.
+	 * `b` is left empty, so it gets a pool of its own for its new leaf,
+	 * instead of keeping the merged pool shared for as long as it lives.
+	 */
+	struct Subtree left = { a->root, get_height(a) };
+	struct Subtree right = { b->root, get_height(b) };
+	if (!reserve_nodes(a, 0, (left.height > right.height ? left.height : right.height) + 1))
+		return false;
+	struct Node_Pool *b_pool = pool_new_like(b->pool);
+	if (b_pool == NULL)
+		return false;
+	if (!pool_reserve(b_pool, POOL_LEAF, 1)) {
+		pool_release(b_pool);
+		return false;
+	}
+
+	/* The nodes of `b` can be freed to the pool of `a` from now on */
+	pool_merge(a->pool, b->pool);
+
+	if (a->entry_count == 0) {
+		free_leaf(a, a->root);
+		left.root = NULL;
+	} else {
+		a->last_leaf->next = first_leaf;
+		first_leaf->prev = a->last_leaf;
+	}
+	set_contents(a, join(a, left, right), a->entry_count + b->entry_count);
+	pool_release(b->pool);
+	b->pool = b_pool;
+	set_contents(b, (struct Subtree) { NULL, 0 }, 0);
+	return true;
+}
+
+/*
+ * One level of the index of a frozen btree.  Like a branch, each node of the
+ * level holds the keys of all of its children but the first.  The children of
+ * node `i` are numbered from `i * (node_key_count + 1)` in the level below, or
+ * among the blocks of entries below the last level.
+ */
+struct Frozen_Level {
+	const uint8_t *keys;
+	/* The number of nodes (or blocks) in the level below */
+	size_t child_count;
+	/* The number of entries under each of those, but the last */
+	size_t span;
+};
+
+/*
+ * An immutable copy of a btree.  The entries are stored in one sorted array,
+ * divided into blocks of `block_size` entries, above which is an index of
+ * nodes of `node_key_count` keys, with no pointers or counts.  The levels of
+ * the index are stored one after another from the root down.  Every block but
+ * the last is full, so the index of an entry follows from where it is stored.
+ */
+struct Btree_Frozen {
+	size_t entry_size;
+	size_t key_size;
+	size_t key_offset;
+	bool string_keys;
+	size_t entry_count;
+	size_t block_size;
+	size_t node_key_count;
+	Btree_Compare *compare;
+	const void *compare_cb_data;
+	Key_Search *key_search;
+	Key_Search *branch_key_search;
+	size_t level_count;
+	struct Frozen_Level levels[PATH_LENGTH_MAX];
+	/* The keys of every level, followed by the entries */
+	uint8_t *data;
+	size_t data_size;
+	const uint8_t *entries;
+	/* The allocator of the btree, which outlives it */
+	struct Btree_Allocator allocator;
+};
+
+/*
+ * Freezes a btree into an immutable copy, which is searched without following
+ * pointers, and takes little more memory than its entries, plus a key for
+ * each block.  Nodes of the index hold as many keys as branches of the btree, and
+ * blocks as many entries as its leaves.  The btree is left unchanged.  Returns
+ * NULL if the allocator of the btree fails.
+ */
+struct Btree_Frozen *
+btree_freeze(const struct Btree *btree)
+{
+	const struct Btree_Allocator *allocator = pool_get_allocator(btree->pool);
+	struct Btree_Frozen *frozen = allocator->alloc(allocator->context, sizeof(struct Btree_Frozen), alignof(struct Btree_Frozen));
+	if (frozen == NULL)
+		return NULL;
+	frozen->allocator = *allocator;
+	frozen->entry_size = btree->entry_size;
+	/* The index only holds keys, without normalized keys */
+	frozen->key_size = btree->key_size - (btree->normalize != NULL ? sizeof(uint64_t) : 0);
+	frozen->key_offset = btree->key_offset;
+	frozen->string_keys = btree->string_keys;
+	frozen->entry_count = btree->entry_count;
+	frozen->block_size = btree->leaf_entry_count_max;
+	frozen->node_key_count = btree->branch_child_count_max - 1;
+	frozen->compare = btree->compare;
+	frozen->compare_cb_data = btree->compare_cb_data;
+	frozen->key_search = btree->key_search;
+	frozen->branch_key_search = btree->branch_key_search;
+
+	/*
+	 * Add levels from the blocks up until a single node is left.  Btrees
+	 * in sequence mode have no keys to index.
+	 */
+	size_t fanout = frozen->node_key_count + 1;
+	size_t child_counts[PATH_LENGTH_MAX];
+	size_t level_count = 0;
+	size_t key_count = 0;
+	size_t child_count = (frozen->entry_count + frozen->block_size - 1) / frozen->block_size;
+	while (frozen->compare != NULL && child_count > 1) {
+		child_counts[level_count++] = child_count;
+		child_count = (child_count + fanout - 1) / fanout;
+		key_count += child_count * frozen->node_key_count;
+	}
+	frozen->level_count = level_count;
+
+	/*
+	 * The nodes of the index start at cache lines.  Inline keys are
+	 * copied after the entries.
+	 */
+	size_t keys_size = key_count * frozen->key_size;
+	size_t strings_size = 0;
+	for (const struct Btree_Node *leaf = get_edge_leaf(btree, false); leaf != NULL && btree->inline_keys; leaf = leaf->next)
+		strings_size += get_leaf_heap(btree, leaf)->used;
+	size_t size = keys_size + frozen->entry_count * frozen->entry_size + strings_size;
+	frozen->data_size = size > 0 ? size : 1;
+	frozen->data = allocator->alloc(allocator->context, frozen->data_size, CACHE_LINE_BYTES);
+	if (frozen->data == NULL) {
+		allocator->free(allocator->context, frozen, sizeof(struct Btree_Frozen));
+		return NULL;
+	}
+	frozen->entries = frozen->data + keys_size;
+	uint8_t *entry = frozen->data + keys_size;
+	uint8_t *string = entry + frozen->entry_count * frozen->entry_size;
+	for (const struct Btree_Node *leaf = get_edge_leaf(btree, false); leaf != NULL; leaf = leaf->next) {
+		memcpy(entry, get_leaf_entry_ptr(btree, leaf, 0), leaf->entry_count * frozen->entry_size);
+		for (size_t i = 0; i < leaf->entry_count && btree->inline_keys; i++) {
+			void *copy = entry + i * frozen->entry_size;
+			size_t length = strlen(get_entry_string(btree, copy)) + 1;
+			memcpy(string, get_entry_string(btree, copy), length);
+			set_entry_string(btree, copy, (const char *) string);
+			string += length;
+		}
+		entry += leaf->entry_count * frozen->entry_size;
+	}
+
+	/*
+	 * The key of a child is its first entry.  Children of the last level
+	 * span a block, and each level up, they span `fanout` times as many
+	 * entries.
+	 */
+	const uint8_t *keys = frozen->data;
+	for (size_t i = 0; i < level_count; i++) {
+		struct Frozen_Level *level = &frozen->levels[i];
+		level->keys = keys;
+		level->child_count = child_counts[level_count - i - 1];
+		level->span = frozen->block_size;
+		for (size_t j = i + 1; j < level_count; j++)
+			level->span *= fanout;
+		for (size_t child_index = 0; child_index < level->child_count; child_index++) {
+			if (child_index % fanout == 0)
+				continue;
+			size_t key_index = child_index / fanout * frozen->node_key_count + child_index % fanout - 1;
+			uint8_t *key = (uint8_t *) keys + key_index * frozen->key_size;
+			const uint8_t *entry = frozen->entries + child_index * level->span * frozen->entry_size;
+			if (frozen->string_keys) {
+				const char *left, *right;
+				memcpy(&left, entry - frozen->entry_size + frozen->key_offset, sizeof(const char *));
+				memcpy(&right, entry + frozen->key_offset, sizeof(const char *));
+				encode_separator(key, frozen->key_size, left, right);
+			} else {
+				memcpy(key, entry + frozen->key_offset, frozen->key_size);
+			}
+		}
+		keys += (level->child_count + fanout - 1) / fanout * frozen->node_key_count * frozen->key_size;
+	}
+	return frozen;
+}
+
+/*
+ * Frees a frozen btree
+ */
+void
+btree_frozen_free(struct Btree_Frozen *frozen)
+{
+	struct Btree_Allocator allocator = frozen->allocator;
+	allocator.free(allocator.context, frozen->data, frozen->data_size);
+	allocator.free(allocator.context, frozen, sizeof(struct Btree_Frozen));
+}
+
+/*
+ * Returns the number of `count`-many sorted keys of a frozen btree, spaced
+ * `stride` bytes apart, that come before `target`, or, if `upper` is true,
+ * that do not come after it.  `key_search` searches keys of a built-in type.
+ */
+static size_t
+frozen_search(const struct Btree_Frozen *restrict frozen, Key_Search *key_search, const uint8_t *restrict keys, size_t stride, size_t count, const void *restrict target, bool upper)
+{
+	if (key_search != NULL)
+		return key_search(keys, stride, count, target, upper);
+
+	size_t low = 0;
+	size_t high = count;
+	while (low != high) {
+		size_t middle = (low + high) / 2;
+		int comparison = frozen->compare(keys + middle * stride, target, frozen->compare_cb_data);
+		if (comparison < 0 || (comparison == 0 && !upper))
+			high = middle;
+		else
+			low = middle + 1;
+	}
+	return low;
+}
+
+/*
+ * Works like `frozen_search` on the string separators of the node of a level
+ * whose first child is `first_child`.  A truncated separator that the target
+ * starts with is decided by the first entry of the child after it.
+ */
+static size_t
+frozen_separator_search(const struct Btree_Frozen *restrict frozen, const struct Frozen_Level *restrict level, const uint8_t *restrict keys, size_t first_child, size_t count, const void *restrict target, bool upper)
+{
+	const char *string;
+	memcpy(&string, target, sizeof(const char *));
+	size_t low = 0;
+	size_t high = count;
+	while (low != high) {
+		size_t middle = (low + high) / 2;
+		bool undecided = false;
+		int comparison = compare_separator(keys + middle * frozen->key_size, string, &undecided);
+		if (undecided) {
+			const uint8_t *entry = frozen->entries + (first_child + middle + 1) * level->span * frozen->entry_size;
+			comparison = frozen->compare(entry + frozen->key_offset, target, frozen->compare_cb_data);
+		}
+		if (comparison < 0 || (comparison == 0 && !upper))
+			high = middle;
+		else
+			low = middle + 1;
+	}
+	return low;
+}
+
+/*
+ * Returns the index of the first entry of a frozen btree that does not come
+ * before `key`, or, if `upper` is true, of the first entry that comes after
+ * `key`.  Descending the index counts the keys before `key` rather than the
+ * ones matching it, so the block it ends at holds the position even if
+ * matching entries start in an earlier block.
+ */
+static size_t
+frozen_locate(const struct Btree_Frozen *restrict frozen, const void *restrict key, bool upper)
+{
+	if (frozen->compare == NULL)
+		die("Attempted to look up an entry by key in a btree in sequence mode.");
+
+	size_t fanout = frozen->node_key_count + 1;
+	size_t node_index = 0;
+	for (size_t i = 0; i < frozen->level_count; i++) {
+		const struct Frozen_Level *level = &frozen->levels[i];
+		size_t first_child = node_index * fanout;
+		size_t key_count = level->child_count - first_child;
+		if (key_count > fanout)
+			key_count = fanout;
+		const uint8_t *keys = level->keys + node_index * frozen->node_key_count * frozen->key_size;
+		if (frozen->string_keys)
+			node_index = first_child + frozen_separator_search(frozen, level, keys, first_child, key_count - 1, key, upper);
+		else
+			node_index = first_child + frozen_search(frozen, frozen->branch_key_search, keys, frozen->key_size, key_count - 1, key, upper);
+	}
+
+	size_t start = node_index * frozen->block_size;
+	size_t count = frozen->entry_count - start;
+	if (count > frozen->block_size)
+		count = frozen->block_size;
+	const uint8_t *keys = frozen->entries + start * frozen->entry_size + frozen->key_offset;
+	return start + frozen_search(frozen, frozen->key_search, keys, frozen->entry_size, count, key, upper);
+}
+
+/*
+ * Works like `btree_fetch`.  Since the entries are stored in a single array,
+ * `*count` is set to the number of entries from the requested one to the end.
+ */
+const void *
+btree_frozen_fetch(const struct Btree_Frozen *restrict frozen, size_t entry_index, size_t *restrict count)
+{
+	*count = frozen->entry_count - entry_index;
+	return frozen->entries + entry_index * frozen->entry_size;
+}
+
+/*
+ * Works like `btree_find`, with `*count` set as in `btree_frozen_fetch`
+ */
+const void *
+btree_frozen_find(const struct Btree_Frozen *restrict frozen, const void *restrict key, size_t *restrict index, size_t *restrict count)
+{
+	const void *entry = btree_frozen_lower_bound(frozen, key, index, count);
+	if (entry == NULL || frozen->compare((const uint8_t *) entry + frozen->key_offset, key, frozen->compare_cb_data) != 0) {
+		*count = 0;
+		return NULL;
+	}
+	return entry;
+}
+
+/*
+ * Works like `btree_lower_bound`, with `*count` set as in `btree_frozen_fetch`
+ */
+const void *
+btree_frozen_lower_bound(const struct Btree_Frozen *restrict frozen, const void *restrict key, size_t *restrict index, size_t *restrict count)
+{
+	*index = frozen_locate(frozen, key, false);
+	const void *entry = btree_frozen_fetch(frozen, *index, count);
+	return *count > 0 ? entry : NULL;
+}
+
+/*
+ * Works like `btree_upper_bound`, with `*count` set as in `btree_frozen_fetch`
+ */
+const void *
+btree_frozen_upper_bound(const struct Btree_Frozen *restrict frozen, const void *restrict key, size_t *restrict index, size_t *restrict count)
+{
+	*index = frozen_locate(frozen, key, true);
+	const void *entry = btree_frozen_fetch(frozen, *index, count);
+	return *count > 0 ? entry : NULL;
+}
+
+/*
+ * Works like `btree_rank`
+ */
+size_t
+btree_frozen_rank(const struct Btree_Frozen *restrict frozen, const void *restrict key)
+{
+	return frozen_locate(frozen, key, false);
+}
+
+/*
+ * Works like `btree_count_range`
+ */
+size_t
+btree_frozen_count_range(const struct Btree_Frozen *restrict frozen, const void *restrict low, const void *restrict high)
+{
+	if (frozen->compare == NULL)
+		die("Attempted to look up an entry by key in a btree in sequence mode.");
+	if (frozen->compare(low, high, frozen->compare_cb_data) <= 0)
+		return 0;
+	return frozen_locate(frozen, high, false) - frozen_locate(frozen, low, false);
 }
 
 /*
@@ -539,16 +3571,26 @@ display_node(const struct Btree *restrict btree, const struct Btree_Node *restri
 	} else {
 		printf(". -> [%lu children, %lu entries]{\n", node->child_count, node->entry_count);
 		for (size_t i = 0; i < node->child_count; i++) {
-			if (i != 0) {
+			/* Btrees in sequence mode have no keys to separate children by */
+			if (i != 0 && btree->compare != NULL) {
 				indent(depth + 1);
 				printf("(");
-				display_entry(get_branch_key_ptr(btree, node, i));
+				/*
+				 * Branches only hold keys, so other than string
+				 * separators, which are printed as they are,
+				 * show the first entry of the child instead
+				 */
+				const uint8_t *key = get_branch_key_ptr(btree, node, i);
+				if (btree->string_keys)
+					printf("\"%.*s\"%s", key[0] & ~SEPARATOR_TRUNCATED, (const char *) key + 1, key[0] & SEPARATOR_TRUNCATED ? "..." : "");
+				else
+					display_entry(get_first_entry_ptr(btree, *get_branch_child_ptr_ptr(btree, node, i)));
 				printf(")\n");
 			}
 			display_node(btree, *get_branch_child_ptr_ptr(btree, node, i), depth + 1, display_entry);
 			if (i + 1 < node->child_count) {
 				indent(depth + 1);
-				printf("[%lu cumulative entries]\n", get_branch_cumulative_sizes(btree, node)[i]);
+				printf("[%lu cumulative entries]\n", get_child_offset(btree, node, i + 1));
 			}
 		}
 		indent(depth);
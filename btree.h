@@ -1,26 +1,284 @@
 #ifndef _BTREE_H
 #define _BTREE_H
 
+#include <stddef.h>
 #include <stdint.h>
+#include <stdbool.h>
 
 struct Btree;
+struct Btree_Node;
+struct Btree_Frozen;
+
+/*
+ * A position within a btree, used for iterating over its entries in order.
+ * The members are private.  A cursor is invalidated by any modification of
+ * its btree.
+ */
+struct Btree_Cursor {
+	const struct Btree *btree;
+	const struct Btree_Node *leaf;
+	size_t entry_index;
+	size_t index;
+};
 
 /*
  * Comparison function should return 0 if the second argument matches the first
  * argument, a negative value if the second argument comes before the first
  * argument, and a positive value if the second argument comes after the first
- * argument.
+ * argument.  The arguments are keys, which are whole entries unless the btree
+ * is configured with a `key_size` or `key_offset`.
  */
 typedef int Btree_Compare(const void *, const void *, const void *);
 
+/*
+ * Normalization function mapping a key to a number that orders it like the
+ * comparison function does: a key that comes before another must not map to a
+ * larger number, and keys that compare equal must map to the same number.
+ * The second argument is the comparison function's data.
+ */
+typedef uint64_t Btree_Normalize(const void *, const void *);
+
 typedef void Btree_Display_Entry(const void *);
 
+/*
+ * How a btree handles the insertion of an entry matching one already in it
+ */
+enum Btree_Duplicates {
+	/* The entry is not inserted */
+	BTREE_DUPLICATES_REJECT,
+	/* The entry replaces the matching entry */
+	BTREE_DUPLICATES_OVERWRITE,
+	/* The entry is inserted after all matching entries */
+	BTREE_DUPLICATES_ALLOW,
+};
+
+/*
+ * The type of the key that entries are ordered by.  Entries of a btree with a
+ * built-in key type hold the key at `key_offset`, and are ordered by it in
+ * ascending order without a comparison function, which lets searches compare
+ * many keys at once.
+ */
+enum Btree_Key_Type {
+	/* Entries are ordered by the comparison function */
+	BTREE_KEY_CUSTOM,
+	BTREE_KEY_U32,
+	BTREE_KEY_I32,
+	BTREE_KEY_U64,
+	BTREE_KEY_I64,
+	/*
+	 * The key is a pointer to a NUL-terminated string, ordered bytewise.
+	 * Branches store the shortest prefix of each separator that tells
+	 * its children apart rather than the whole key.
+	 */
+	BTREE_KEY_STRING,
+};
+
+/*
+ * The types of the fields of a composite key
+ */
+enum Btree_Field_Type {
+	BTREE_FIELD_U32,
+	BTREE_FIELD_I32,
+	BTREE_FIELD_U64,
+	BTREE_FIELD_I64,
+	/* A pointer to a NUL-terminated string, ordered bytewise */
+	BTREE_FIELD_STRING,
+	/* `size` bytes, ordered like memcmp orders them */
+	BTREE_FIELD_BYTES,
+};
+
+/*
+ * A field of a composite key, at `offset` within the key
+ */
+struct Btree_Key_Field {
+	enum Btree_Field_Type type;
+	size_t offset;
+	/* The size of a field of bytes, ignored for other types */
+	size_t size;
+	bool descending;
+};
+
+/*
+ * The fields of a composite key, which is ordered by its first field, then by
+ * its second field among keys with equal first fields, and so on.  Passed as
+ * the data of `btree_compare_fields`.
+ */
+struct Btree_Key_Fields {
+	const struct Btree_Key_Field *fields;
+	size_t count;
+};
+
+/*
+ * How a branch keeps track of the number of entries under each of its
+ * children
+ */
+enum Btree_Counts {
+	/*
+	 * Each child's count is stored summed with those of the children
+	 * before it.  Finding a child by index is a binary search, but every
+	 * insertion or removal updates the sums of all later children.
+	 */
+	BTREE_COUNTS_CUMULATIVE,
+	/*
+	 * Each child's count is stored on its own.  An insertion or removal
+	 * only updates a single count, but finding a child by index scans the
+	 * counts before it, four at a time where AVX2 is available, which
+	 * suits btrees with large branches that are written more often than
+	 * they are read by index.
+	 */
+	BTREE_COUNTS_PER_CHILD,
+};
+
+enum Btree_Insert_Result {
+	BTREE_INSERTED,
+	BTREE_OVERWRITTEN,
+	BTREE_REJECTED,
+	/* The btree's allocator could not provide memory for a new node */
+	BTREE_FAILED,
+};
+
+/*
+ * Where a btree gets its memory from.  Nodes are allocated many at a time in
+ * blocks, and the btree structure itself is allocated separately.
+ */
+struct Btree_Allocator {
+	/*
+	 * Returns `size` bytes aligned to `alignment`, which is a power of
+	 * two, or NULL if the memory can't be allocated
+	 */
+	void *(*alloc)(void *context, size_t size, size_t alignment);
+	/* Frees `size` bytes returned by `alloc` */
+	void (*free)(void *context, void *ptr, size_t size);
+	void *context;
+	/*
+	 * The alignment of each node, such as the size of a cache line, or 0
+	 * for the alignment of `max_align_t`
+	 */
+	size_t alignment;
+};
+
+/*
+ * The parameters of a new btree.  Members that are left zeroed get their
+ * default behavior.
+ */
+struct Btree_Config {
+	/* At least 4 */
+	size_t branch_child_count_max;
+	/* At least 2 */
+	size_t leaf_entry_count_max;
+	/*
+	 * The sizes of branches and leaves in bytes, or 0 to size them by
+	 * the counts above.  When set, the counts are the most that fit, and
+	 * nodes are aligned to cache lines, or to pages if they're at least a
+	 * page in size.
+	 */
+	size_t branch_node_size;
+	size_t leaf_node_size;
+	size_t entry_size;
+	/*
+	 * Entries are ordered by a key of `key_size` bytes at `key_offset`
+	 * within them, and branches only store keys.  A `key_size` of 0
+	 * means the size of a built-in key type, which is the only other size
+	 * allowed for it, or the rest of the entry.  Lookups take keys rather
+	 * than entries.  For string keys,
+	 * `key_size` is the size of the slot that branches store each
+	 * separator in, from 2 to 128 bytes, or 0 for 64.  Separators that
+	 * don't fit are compared with the key of an entry when a lookup
+	 * matches all of the slot, so the slot should hold the prefixes that
+	 * keys commonly share, plus a byte.
+	 */
+	size_t key_size;
+	size_t key_offset;
+	/*
+	 * For string keys, whether leaves store copies of the strings next
+	 * to the entries, which then point to the copies, so that searching a
+	 * leaf doesn't follow pointers out of it.  Leaves are split and
+	 * merged by the bytes they hold rather than by entry counts, and must
+	 * be sized with `leaf_node_size`.  A key, with its entry, may take up
+	 * to a quarter of a leaf.  Like entries, the copies move when the
+	 * btree changes, and the copy of a removed entry is gone with it.
+	 */
+	bool inline_keys;
+	/*
+	 * NULL for a btree in sequence mode, where entries are ordered by
+	 * where they're inserted instead of by key.  Ignored unless `key_type`
+	 * is `BTREE_KEY_CUSTOM`.  One of the built-in comparison functions
+	 * for a key type, such as `btree_compare_u64`, is recognized and
+	 * makes it the btree's key type.
+	 */
+	Btree_Compare *compare;
+	const void *compare_cb_data;
+	/*
+	 * NULL, or a function normalizing custom keys, such as one reading
+	 * the first 8 bytes of a string as a big-endian number.  Nodes store
+	 * the number of each key next to it, so that searches compare numbers
+	 * and only call `compare` on keys whose numbers are equal, which
+	 * spares them from following pointers in keys.  Composite keys
+	 * compared with `btree_compare_fields` are normalized by their first
+	 * field unless this is set.
+	 */
+	Btree_Normalize *normalize;
+	enum Btree_Key_Type key_type;
+	enum Btree_Duplicates duplicates;
+	enum Btree_Counts counts;
+	/*
+	 * Whether to prefetch each child a descent is about to visit, and the
+	 * leaf after the one a cursor moves into.  Pays off for btrees larger
+	 * than the CPU's caches.
+	 */
+	bool prefetch;
+	/*
+	 * NULL to allocate memory with malloc, exiting the process if there
+	 * is none.  The allocator is copied.
+	 */
+	const struct Btree_Allocator *allocator;
+};
+
+int btree_compare_u32(const void *, const void *, const void *);
+int btree_compare_i32(const void *, const void *, const void *);
+int btree_compare_u64(const void *, const void *, const void *);
+int btree_compare_i64(const void *, const void *, const void *);
+int btree_compare_string(const void *, const void *, const void *);
+int btree_compare_fields(const void *, const void *, const void *);
+
 struct Btree *btree_new(size_t, size_t, size_t, Btree_Compare *, const void *);
+struct Btree *btree_new_sized(size_t, size_t, size_t, Btree_Compare *, const void *);
+struct Btree *btree_new_config(const struct Btree_Config *);
 void btree_free(struct Btree *);
 
-void btree_insert(struct Btree *, const void *);
+enum Btree_Insert_Result btree_insert(struct Btree *, const void *, const void **);
+void *btree_insert_at(struct Btree *, size_t, const void *);
+size_t btree_insert_batch(struct Btree *, const void *, size_t);
+bool btree_bulk_load(struct Btree *, const void *, size_t, double);
+bool btree_remove(struct Btree *, const void *, void *);
+void btree_remove_at(struct Btree *, size_t, void *);
+struct Btree *btree_split_at(struct Btree *, size_t);
+bool btree_concat(struct Btree *, struct Btree *);
 
 const void *btree_fetch(const struct Btree *, size_t, size_t *);
+const void *btree_find(const struct Btree *, const void *, size_t *, size_t *);
+const void *btree_lower_bound(const struct Btree *, const void *, size_t *, size_t *);
+const void *btree_upper_bound(const struct Btree *, const void *, size_t *, size_t *);
+size_t btree_rank(const struct Btree *, const void *);
+size_t btree_count_range(const struct Btree *, const void *, const void *);
+
+const void *btree_cursor_first(struct Btree_Cursor *, const struct Btree *);
+const void *btree_cursor_last(struct Btree_Cursor *, const struct Btree *);
+const void *btree_cursor_seek(struct Btree_Cursor *, const struct Btree *, const void *);
+const void *btree_cursor_seek_index(struct Btree_Cursor *, const struct Btree *, size_t);
+const void *btree_cursor_get(const struct Btree_Cursor *);
+size_t btree_cursor_index(const struct Btree_Cursor *);
+const void *btree_cursor_next(struct Btree_Cursor *);
+const void *btree_cursor_prev(struct Btree_Cursor *);
+
+struct Btree_Frozen *btree_freeze(const struct Btree *);
+void btree_frozen_free(struct Btree_Frozen *);
+const void *btree_frozen_fetch(const struct Btree_Frozen *, size_t, size_t *);
+const void *btree_frozen_find(const struct Btree_Frozen *, const void *, size_t *, size_t *);
+const void *btree_frozen_lower_bound(const struct Btree_Frozen *, const void *, size_t *, size_t *);
+const void *btree_frozen_upper_bound(const struct Btree_Frozen *, const void *, size_t *, size_t *);
+size_t btree_frozen_rank(const struct Btree_Frozen *, const void *);
+size_t btree_frozen_count_range(const struct Btree_Frozen *, const void *, const void *);
 
 void btree_display(const struct Btree *, Btree_Display_Entry *);
 
@@ -0,0 +1,614 @@
+/*
+ * A btree specialized at compile time for one entry type, comparison and
+ * fanout.  Because everything is known to the compiler, comparisons are
+ * inlined and entries are copied with fixed sizes, which makes it faster than
+ * the generic btree in btree.h for hot paths.  It supports insertion, removal,
+ * lookups by key and by index, and iteration over entries in order.
+ *
+ * To instantiate it, define the following macros and include this header.
+ * It can be included any number of times with different parameters.
+ *
+ *     BTREE_NAME                     prefix of the names of the generated
+ *                                    types and functions, e.g. `u64_btree`
+ *     BTREE_ENTRY                    the type of the entries
+ *     BTREE_COMPARE(a, b)            compares two entries through pointers to
+ *                                    them, following the convention of
+ *                                    `Btree_Compare`
+ *     BTREE_BRANCH_CHILD_COUNT_MAX   at least 4
+ *     BTREE_LEAF_ENTRY_COUNT_MAX     at least 2
+ *
+ * The generated btree rejects entries matching ones already in it.  For
+ * example,
+ *
+ *     #define BTREE_NAME u64_btree
+ *     #define BTREE_ENTRY uint64_t
+ *     #define BTREE_COMPARE(a, b) ((*(b) > *(a)) - (*(b) < *(a)))
+ *     #define BTREE_BRANCH_CHILD_COUNT_MAX 64
+ *     #define BTREE_LEAF_ENTRY_COUNT_MAX 128
+ *     #include "btree_template.h"
+ *
+ * defines `struct u64_btree`, `u64_btree_new`, `u64_btree_insert` and so on.
+ * The parameters are undefined at the end of this header.
+ */
+
+#ifndef _BTREE_TEMPLATE_H
+#define _BTREE_TEMPLATE_H
+
+#include <string.h>
+#include <stdbool.h>
+
+#include "btree.h"
+#include "util.h"
+
+#define BTREE_TEMPLATE_CONCAT_(a, b) a##b
+#define BTREE_TEMPLATE_CONCAT(a, b) BTREE_TEMPLATE_CONCAT_(a, b)
+/* The name of a generated type or function */
+#define BTREE_T(name) BTREE_TEMPLATE_CONCAT(BTREE_NAME, _##name)
+
+#endif
+
+#if !defined(BTREE_NAME) || !defined(BTREE_ENTRY) || !defined(BTREE_COMPARE) || !defined(BTREE_BRANCH_CHILD_COUNT_MAX) || !defined(BTREE_LEAF_ENTRY_COUNT_MAX)
+#error "BTREE_NAME, BTREE_ENTRY, BTREE_COMPARE, BTREE_BRANCH_CHILD_COUNT_MAX and BTREE_LEAF_ENTRY_COUNT_MAX must be defined before including btree_template.h"
+#endif
+
+/*
+ * The start of every node.  If the node has no children, it is a leaf.
+ */
+struct BTREE_T(node) {
+	size_t child_count;
+	size_t entry_count;
+};
+
+struct BTREE_T(leaf) {
+	struct BTREE_T(node) node;
+	/* The neighboring leaves in order, or NULL at either end */
+	struct BTREE_T(leaf) *prev;
+	struct BTREE_T(leaf) *next;
+	BTREE_ENTRY entries[BTREE_LEAF_ENTRY_COUNT_MAX];
+};
+
+struct BTREE_T(branch) {
+	struct BTREE_T(node) node;
+	/*
+	 * The cumulative sums of the number of entries of each child, except
+	 * the last one, whose count is implied by the branch's entry count
+	 */
+	size_t cumulative_sizes[BTREE_BRANCH_CHILD_COUNT_MAX - 1];
+	/*
+	 * The key in front of each child.  The first child has no key, so the
+	 * first element is unused.
+	 */
+	BTREE_ENTRY keys[BTREE_BRANCH_CHILD_COUNT_MAX];
+	struct BTREE_T(node) *children[BTREE_BRANCH_CHILD_COUNT_MAX];
+};
+
+struct BTREE_NAME {
+	size_t entry_count;
+	struct BTREE_T(node) *root;
+};
+
+/*
+ * A position within a btree.  The members are private.  A cursor is
+ * invalidated by any modification of its btree.
+ */
+struct BTREE_T(cursor) {
+	const struct BTREE_T(leaf) *leaf;
+	size_t entry_index;
+};
+
+static inline struct BTREE_T(leaf) *
+BTREE_T(as_leaf)(const struct BTREE_T(node) *node)
+{
+	return (struct BTREE_T(leaf) *) node;
+}
+
+static inline struct BTREE_T(branch) *
+BTREE_T(as_branch)(const struct BTREE_T(node) *node)
+{
+	return (struct BTREE_T(branch) *) node;
+}
+
+static inline struct BTREE_T(leaf) *
+BTREE_T(create_leaf)(void)
+{
+	struct BTREE_T(leaf) *leaf = xmalloc(sizeof(struct BTREE_T(leaf)));
+	leaf->node.child_count = 0;
+	leaf->node.entry_count = 0;
+	leaf->prev = NULL;
+	leaf->next = NULL;
+	return leaf;
+}
+
+static inline struct BTREE_T(branch) *
+BTREE_T(create_branch)(void)
+{
+	struct BTREE_T(branch) *branch = xmalloc(sizeof(struct BTREE_T(branch)));
+	branch->node.child_count = 0;
+	branch->node.entry_count = 0;
+	return branch;
+}
+
+/*
+ * Returns the index of the first of the items from `low` to `high` that does
+ * not come before `key`, or, if `upper` is true, that comes after `key`
+ */
+static inline size_t
+BTREE_T(search)(const BTREE_ENTRY *items, size_t low, size_t high, const BTREE_ENTRY *key, bool upper)
+{
+	while (low != high) {
+		size_t middle = (low + high) / 2;
+		int comparison = BTREE_COMPARE(&items[middle], key);
+		if (comparison < 0 || (comparison == 0 && !upper))
+			high = middle;
+		else
+			low = middle + 1;
+	}
+	return low;
+}
+
+/*
+ * Returns the index of the child of a branch to descend into to find `key`
+ */
+static inline size_t
+BTREE_T(find_child_by_key)(const struct BTREE_T(branch) *branch, const BTREE_ENTRY *key)
+{
+	return BTREE_T(search)(branch->keys, 1, branch->node.child_count, key, true) - 1;
+}
+
+/*
+ * Returns the index of the child of a branch containing the entry at
+ * `*entry_index`, and sets `*entry_index` to the index within the child
+ */
+static inline size_t
+BTREE_T(find_child_by_index)(const struct BTREE_T(branch) *branch, size_t *entry_index)
+{
+	size_t low = 0;
+	size_t high = branch->node.child_count - 1;
+	while (low != high) {
+		size_t middle = (low + high) / 2;
+		if (branch->cumulative_sizes[middle] > *entry_index)
+			high = middle;
+		else
+			low = middle + 1;
+	}
+	if (low > 0)
+		*entry_index -= branch->cumulative_sizes[low - 1];
+	return low;
+}
+
+/*
+ * Recomputes the cumulative sizes and the entry count of a branch from the
+ * entry counts of its children
+ */
+static inline void
+BTREE_T(recount_branch)(struct BTREE_T(branch) *branch)
+{
+	size_t total = 0;
+	for (size_t i = 0; i < branch->node.child_count; i++) {
+		total += branch->children[i]->entry_count;
+		if (i + 1 < branch->node.child_count)
+			branch->cumulative_sizes[i] = total;
+	}
+	branch->node.entry_count = total;
+}
+
+/*
+ * Moves `count` children of the branch `src`, starting at `src_index`, to
+ * `dst_index` in the branch `dst`, along with their keys.  The ranges may
+ * overlap.
+ */
+static inline void
+BTREE_T(move_children)(struct BTREE_T(branch) *dst, size_t dst_index, struct BTREE_T(branch) *src, size_t src_index, size_t count)
+{
+	memmove(&dst->children[dst_index], &src->children[src_index], count * sizeof(struct BTREE_T(node) *));
+	memmove(&dst->keys[dst_index], &src->keys[src_index], count * sizeof(BTREE_ENTRY));
+}
+
+/*
+ * Inserts a child with its key into a branch that isn't full.  The cumulative
+ * sizes are left for the caller to recompute.
+ */
+static inline void
+BTREE_T(branch_insert)(struct BTREE_T(branch) *branch, size_t child_index, const BTREE_ENTRY *key, struct BTREE_T(node) *child)
+{
+	BTREE_T(move_children)(branch, child_index + 1, branch, child_index, branch->node.child_count - child_index);
+	branch->keys[child_index] = *key;
+	branch->children[child_index] = child;
+	branch->node.child_count++;
+}
+
+static inline struct BTREE_NAME *
+BTREE_T(new)(void)
+{
+	struct BTREE_NAME *btree = xmalloc(sizeof(struct BTREE_NAME));
+	btree->entry_count = 0;
+	btree->root = &BTREE_T(create_leaf)()->node;
+	return btree;
+}
+
+static inline void
+BTREE_T(free_node)(struct BTREE_T(node) *node)
+{
+	for (size_t i = 0; i < node->child_count; i++)
+		BTREE_T(free_node)(BTREE_T(as_branch)(node)->children[i]);
+	free(node);
+}
+
+static inline void
+BTREE_T(free)(struct BTREE_NAME *btree)
+{
+	BTREE_T(free_node)(btree->root);
+	free(btree);
+}
+
+static inline size_t
+BTREE_T(count)(const struct BTREE_NAME *btree)
+{
+	return btree->entry_count;
+}
+
+/*
+ * Inserts an entry into a subtree.  If the node had to be split, the new node
+ * holding its upper half is returned and `*key` is set to the key to place in
+ * front of it.  Otherwise NULL is returned.  `rightmost` is true if the node is
+ * at the end of the btree, in which case a leaf split by an entry going at its
+ * end is left full, so that ascending insertions fill their nodes, and
+ * `*appended` is set so that the branches above it are split the same way.
+ */
+static inline struct BTREE_T(node) *
+BTREE_T(node_insert)(struct BTREE_T(node) *node, const BTREE_ENTRY *entry, bool rightmost, BTREE_ENTRY *key, bool *appended, enum Btree_Insert_Result *result)
+{
+	if (node->child_count == 0) {
+		struct BTREE_T(leaf) *leaf = BTREE_T(as_leaf)(node);
+		size_t index = BTREE_T(search)(leaf->entries, 0, node->entry_count, entry, true);
+		if (index > 0 && BTREE_COMPARE(&leaf->entries[index - 1], entry) == 0) {
+			*result = BTREE_REJECTED;
+			return NULL;
+		}
+		*result = BTREE_INSERTED;
+
+		struct BTREE_T(leaf) *target = leaf;
+		struct BTREE_T(leaf) *new_leaf = NULL;
+		if (node->entry_count == BTREE_LEAF_ENTRY_COUNT_MAX) {
+			size_t kept = rightmost && index == node->entry_count ? BTREE_LEAF_ENTRY_COUNT_MAX : BTREE_LEAF_ENTRY_COUNT_MAX / 2;
+			*appended = kept == BTREE_LEAF_ENTRY_COUNT_MAX;
+			new_leaf = BTREE_T(create_leaf)();
+			new_leaf->node.entry_count = BTREE_LEAF_ENTRY_COUNT_MAX - kept;
+			memcpy(new_leaf->entries, &leaf->entries[kept], new_leaf->node.entry_count * sizeof(BTREE_ENTRY));
+			node->entry_count = kept;
+
+			new_leaf->prev = leaf;
+			new_leaf->next = leaf->next;
+			if (leaf->next != NULL)
+				leaf->next->prev = new_leaf;
+			leaf->next = new_leaf;
+
+			if (index > kept || kept == BTREE_LEAF_ENTRY_COUNT_MAX) {
+				target = new_leaf;
+				index -= kept;
+			}
+		}
+
+		memmove(&target->entries[index + 1], &target->entries[index], (target->node.entry_count - index) * sizeof(BTREE_ENTRY));
+		target->entries[index] = *entry;
+		target->node.entry_count++;
+		if (new_leaf == NULL)
+			return NULL;
+		*key = new_leaf->entries[0];
+		return &new_leaf->node;
+	}
+
+	struct BTREE_T(branch) *branch = BTREE_T(as_branch)(node);
+	size_t child_index = BTREE_T(find_child_by_key)(branch, entry);
+	bool child_rightmost = rightmost && child_index == node->child_count - 1;
+	struct BTREE_T(node) *new_child = BTREE_T(node_insert)(branch->children[child_index], entry, child_rightmost, key, appended, result);
+	if (*result != BTREE_INSERTED)
+		return NULL;
+	if (new_child == NULL) {
+		for (size_t i = child_index; i + 1 < node->child_count; i++)
+			branch->cumulative_sizes[i]++;
+		node->entry_count++;
+		return NULL;
+	}
+
+	if (node->child_count < BTREE_BRANCH_CHILD_COUNT_MAX) {
+		BTREE_T(branch_insert)(branch, child_index + 1, key, new_child);
+		BTREE_T(recount_branch)(branch);
+		return NULL;
+	}
+
+	/*
+	 * Split the branch in half, or, if the new child was split off the end
+	 * of the btree by an append, keep all but the last child and start the
+	 * new branch with it
+	 */
+	size_t kept = child_rightmost && *appended ? node->child_count - 1 : node->child_count / 2;
+	struct BTREE_T(branch) *new_branch = BTREE_T(create_branch)();
+	new_branch->node.child_count = node->child_count - kept;
+	BTREE_T(move_children)(new_branch, 0, branch, kept, new_branch->node.child_count);
+	node->child_count = kept;
+
+	if (child_index < kept)
+		BTREE_T(branch_insert)(branch, child_index + 1, key, new_child);
+	else
+		BTREE_T(branch_insert)(new_branch, child_index - kept + 1, key, new_child);
+	BTREE_T(recount_branch)(branch);
+	BTREE_T(recount_branch)(new_branch);
+	*key = new_branch->keys[0];
+	return &new_branch->node;
+}
+
+/*
+ * Inserts an entry into a btree.  Returns `BTREE_INSERTED`, or
+ * `BTREE_REJECTED` if it matches an entry already in the btree.
+ */
+static inline enum Btree_Insert_Result
+BTREE_T(insert)(struct BTREE_NAME *btree, const BTREE_ENTRY *entry)
+{
+	enum Btree_Insert_Result result;
+	BTREE_ENTRY key;
+	bool appended = false;
+	struct BTREE_T(node) *new_node = BTREE_T(node_insert)(btree->root, entry, true, &key, &appended, &result);
+	if (new_node != NULL) {
+		struct BTREE_T(branch) *root = BTREE_T(create_branch)();
+		root->node.child_count = 2;
+		root->children[0] = btree->root;
+		root->children[1] = new_node;
+		root->keys[1] = key;
+		BTREE_T(recount_branch)(root);
+		btree->root = &root->node;
+	}
+	if (result == BTREE_INSERTED)
+		btree->entry_count++;
+	return result;
+}
+
+/*
+ * Returns a pointer to the entry at `entry_index`, which must be less than the
+ * entry count
+ */
+static inline const BTREE_ENTRY *
+BTREE_T(fetch)(const struct BTREE_NAME *btree, size_t entry_index)
+{
+	const struct BTREE_T(node) *node = btree->root;
+	while (node->child_count != 0) {
+		const struct BTREE_T(branch) *branch = BTREE_T(as_branch)(node);
+		node = branch->children[BTREE_T(find_child_by_index)(branch, &entry_index)];
+	}
+	return &BTREE_T(as_leaf)(node)->entries[entry_index];
+}
+
+/*
+ * Positions a cursor at the first entry that does not come before `key`, and
+ * returns a pointer to it, or NULL if there is no such entry.  Unless `index`
+ * is NULL, `*index` is set to the index of the position.
+ */
+static inline const BTREE_ENTRY *
+BTREE_T(cursor_seek)(struct BTREE_T(cursor) *cursor, const struct BTREE_NAME *btree, const BTREE_ENTRY *key, size_t *index)
+{
+	const struct BTREE_T(node) *node = btree->root;
+	size_t rank = 0;
+	while (node->child_count != 0) {
+		const struct BTREE_T(branch) *branch = BTREE_T(as_branch)(node);
+		size_t child_index = BTREE_T(find_child_by_key)(branch, key);
+		if (child_index > 0)
+			rank += branch->cumulative_sizes[child_index - 1];
+		node = branch->children[child_index];
+	}
+
+	const struct BTREE_T(leaf) *leaf = BTREE_T(as_leaf)(node);
+	size_t entry_index = BTREE_T(search)(leaf->entries, 0, node->entry_count, key, false);
+	if (index != NULL)
+		*index = rank + entry_index;
+	if (entry_index == node->entry_count && leaf->next != NULL) {
+		leaf = leaf->next;
+		entry_index = 0;
+	}
+	cursor->leaf = leaf;
+	cursor->entry_index = entry_index;
+	return entry_index < leaf->node.entry_count ? &leaf->entries[entry_index] : NULL;
+}
+
+/*
+ * Returns a pointer to the first entry that does not come before `key`, or
+ * NULL if there is no such entry.  `*index` is set to the index of the entry,
+ * or to the entry count if there is none, unless `index` is NULL.
+ */
+static inline const BTREE_ENTRY *
+BTREE_T(lower_bound)(const struct BTREE_NAME *btree, const BTREE_ENTRY *key, size_t *index)
+{
+	struct BTREE_T(cursor) cursor;
+	return BTREE_T(cursor_seek)(&cursor, btree, key, index);
+}
+
+/*
+ * Returns a pointer to the entry matching `key`, or NULL if there is none.
+ * `*index` is set as in `lower_bound`.
+ */
+static inline const BTREE_ENTRY *
+BTREE_T(find)(const struct BTREE_NAME *btree, const BTREE_ENTRY *key, size_t *index)
+{
+	const BTREE_ENTRY *entry = BTREE_T(lower_bound)(btree, key, index);
+	if (entry == NULL || BTREE_COMPARE(entry, key) != 0)
+		return NULL;
+	return entry;
+}
+
+/*
+ * Positions a cursor at the first entry of a btree and returns a pointer to
+ * it, or NULL if the btree is empty
+ */
+static inline const BTREE_ENTRY *
+BTREE_T(cursor_first)(struct BTREE_T(cursor) *cursor, const struct BTREE_NAME *btree)
+{
+	const struct BTREE_T(node) *node = btree->root;
+	while (node->child_count != 0)
+		node = BTREE_T(as_branch)(node)->children[0];
+	cursor->leaf = BTREE_T(as_leaf)(node);
+	cursor->entry_index = 0;
+	return node->entry_count > 0 ? &cursor->leaf->entries[0] : NULL;
+}
+
+/*
+ * Advances a cursor to the next entry and returns a pointer to it, or NULL if
+ * the cursor has reached the end of the btree
+ */
+static inline const BTREE_ENTRY *
+BTREE_T(cursor_next)(struct BTREE_T(cursor) *cursor)
+{
+	if (cursor->entry_index < cursor->leaf->node.entry_count)
+		cursor->entry_index++;
+	if (cursor->entry_index == cursor->leaf->node.entry_count && cursor->leaf->next != NULL) {
+		cursor->leaf = cursor->leaf->next;
+		cursor->entry_index = 0;
+	}
+	if (cursor->entry_index == cursor->leaf->node.entry_count)
+		return NULL;
+	return &cursor->leaf->entries[cursor->entry_index];
+}
+
+static inline bool
+BTREE_T(node_is_underfull)(const struct BTREE_T(node) *node)
+{
+	if (node->child_count == 0)
+		return node->entry_count < BTREE_LEAF_ENTRY_COUNT_MAX / 2;
+	return node->child_count < BTREE_BRANCH_CHILD_COUNT_MAX / 2;
+}
+
+/*
+ * Restores the minimum size of the child of a branch at `child_index` by
+ * merging it with a sibling, or, if the two would not fit in a single node,
+ * by moving entries or children over from the sibling
+ */
+static inline void
+BTREE_T(rebalance_child)(struct BTREE_T(branch) *branch, size_t child_index)
+{
+	if (branch->node.child_count < 2)
+		return;
+
+	size_t left_index = child_index > 0 ? child_index - 1 : 0;
+	struct BTREE_T(node) *left = branch->children[left_index];
+	struct BTREE_T(node) *right = branch->children[left_index + 1];
+	BTREE_ENTRY *separator = &branch->keys[left_index + 1];
+
+	if (left->child_count == 0) {
+		struct BTREE_T(leaf) *left_leaf = BTREE_T(as_leaf)(left);
+		struct BTREE_T(leaf) *right_leaf = BTREE_T(as_leaf)(right);
+		size_t total = left->entry_count + right->entry_count;
+		if (total <= BTREE_LEAF_ENTRY_COUNT_MAX) {
+			memcpy(&left_leaf->entries[left->entry_count], right_leaf->entries, right->entry_count * sizeof(BTREE_ENTRY));
+			left->entry_count = total;
+			left_leaf->next = right_leaf->next;
+			if (right_leaf->next != NULL)
+				right_leaf->next->prev = left_leaf;
+			BTREE_T(move_children)(branch, left_index + 1, branch, left_index + 2, branch->node.child_count - left_index - 2);
+			branch->node.child_count--;
+			free(right);
+		} else {
+			size_t left_count = total / 2;
+			if (left->entry_count < left_count) {
+				size_t moved = left_count - left->entry_count;
+				memcpy(&left_leaf->entries[left->entry_count], right_leaf->entries, moved * sizeof(BTREE_ENTRY));
+				memmove(right_leaf->entries, &right_leaf->entries[moved], (right->entry_count - moved) * sizeof(BTREE_ENTRY));
+			} else {
+				size_t moved = left->entry_count - left_count;
+				memmove(&right_leaf->entries[moved], right_leaf->entries, right->entry_count * sizeof(BTREE_ENTRY));
+				memcpy(right_leaf->entries, &left_leaf->entries[left_count], moved * sizeof(BTREE_ENTRY));
+			}
+			left->entry_count = left_count;
+			right->entry_count = total - left_count;
+			*separator = right_leaf->entries[0];
+		}
+	} else {
+		/*
+		 * Children are rotated through the parent: the separator moves
+		 * down in front of the right node's old first child, and the
+		 * key in front of its new first child moves up
+		 */
+		struct BTREE_T(branch) *left_branch = BTREE_T(as_branch)(left);
+		struct BTREE_T(branch) *right_branch = BTREE_T(as_branch)(right);
+		size_t total = left->child_count + right->child_count;
+		right_branch->keys[0] = *separator;
+		if (total <= BTREE_BRANCH_CHILD_COUNT_MAX) {
+			BTREE_T(move_children)(left_branch, left->child_count, right_branch, 0, right->child_count);
+			left->child_count = total;
+			BTREE_T(recount_branch)(left_branch);
+			BTREE_T(move_children)(branch, left_index + 1, branch, left_index + 2, branch->node.child_count - left_index - 2);
+			branch->node.child_count--;
+			free(right);
+		} else {
+			size_t left_count = total / 2;
+			if (left->child_count < left_count) {
+				size_t moved = left_count - left->child_count;
+				BTREE_T(move_children)(left_branch, left->child_count, right_branch, 0, moved);
+				BTREE_T(move_children)(right_branch, 0, right_branch, moved, right->child_count - moved);
+			} else {
+				size_t moved = left->child_count - left_count;
+				BTREE_T(move_children)(right_branch, moved, right_branch, 0, right->child_count);
+				BTREE_T(move_children)(right_branch, 0, left_branch, left_count, moved);
+			}
+			left->child_count = left_count;
+			right->child_count = total - left_count;
+			*separator = right_branch->keys[0];
+			BTREE_T(recount_branch)(left_branch);
+			BTREE_T(recount_branch)(right_branch);
+		}
+	}
+	BTREE_T(recount_branch)(branch);
+}
+
+/*
+ * Removes the entry matching `key` from a subtree, copying it to `removed`
+ * unless `removed` is NULL.  Returns false if there is no such entry.
+ */
+static inline bool
+BTREE_T(node_remove)(struct BTREE_T(node) *node, const BTREE_ENTRY *key, BTREE_ENTRY *removed)
+{
+	if (node->child_count == 0) {
+		struct BTREE_T(leaf) *leaf = BTREE_T(as_leaf)(node);
+		size_t index = BTREE_T(search)(leaf->entries, 0, node->entry_count, key, false);
+		if (index == node->entry_count || BTREE_COMPARE(&leaf->entries[index], key) != 0)
+			return false;
+		if (removed != NULL)
+			*removed = leaf->entries[index];
+		memmove(&leaf->entries[index], &leaf->entries[index + 1], (node->entry_count - index - 1) * sizeof(BTREE_ENTRY));
+		node->entry_count--;
+		return true;
+	}
+
+	struct BTREE_T(branch) *branch = BTREE_T(as_branch)(node);
+	size_t child_index = BTREE_T(find_child_by_key)(branch, key);
+	struct BTREE_T(node) *child = branch->children[child_index];
+	if (!BTREE_T(node_remove)(child, key, removed))
+		return false;
+	for (size_t i = child_index; i + 1 < node->child_count; i++)
+		branch->cumulative_sizes[i]--;
+	node->entry_count--;
+	if (BTREE_T(node_is_underfull)(child))
+		BTREE_T(rebalance_child)(branch, child_index);
+	return true;
+}
+
+/*
+ * Removes the entry matching `key`, copying it to `removed` unless `removed`
+ * is NULL.  Returns false if there is no such entry.
+ */
+static inline bool
+BTREE_T(remove)(struct BTREE_NAME *btree, const BTREE_ENTRY *key, BTREE_ENTRY *removed)
+{
+	if (!BTREE_T(node_remove)(btree->root, key, removed))
+		return false;
+	btree->entry_count--;
+	while (btree->root->child_count == 1) {
+		struct BTREE_T(node) *old_root = btree->root;
+		btree->root = BTREE_T(as_branch)(old_root)->children[0];
+		free(old_root);
+	}
+	return true;
+}
+
+#undef BTREE_NAME
+#undef BTREE_ENTRY
+#undef BTREE_COMPARE
+#undef BTREE_BRANCH_CHILD_COUNT_MAX
+#undef BTREE_LEAF_ENTRY_COUNT_MAX
@@ -0,0 +1,398 @@
+/*
+ * Pools that btree nodes are carved out of.  A pool allocates memory in
+ * blocks holding many nodes of one size class, which grow geometrically, and
+ * keeps freed nodes in a free list for reuse.  Btrees split off from one
+ * another share a pool, and concatenating btrees merges their pools, so a
+ * pool is reference counted and merged pools form a tree whose root owns all
+ * of the blocks.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdalign.h>
+#include <stddef.h>
+
+#include "pool.h"
+#include "util.h"
+
+/* The number of nodes in the first block of each size class */
+#define FIRST_BLOCK_NODE_COUNT 4
+/* The size that blocks stop growing at, in bytes */
+#define MAX_BLOCK_SIZE ((size_t) 1 << 20)
+
+/*
+ * The end of a block, which follows its nodes so that they start at the
+ * alignment of the block.  Nodes are at least as aligned as this structure.
+ */
+struct Pool_Block {
+	struct Pool_Block *next;
+	/* The size of the block, including this structure */
+	size_t size;
+};
+
+/*
+ * A node in a free list, which is stored in the memory of the freed node
+ */
+struct Free_Node {
+	struct Free_Node *next;
+};
+
+struct Size_Class {
+	/* The size of each node, rounded up to keep nodes aligned */
+	size_t node_size;
+	size_t alignment;
+	/* Nodes that were freed and can be handed out again */
+	struct Free_Node *free_list;
+	size_t free_count;
+	/* The part of the last block of the class that no node was carved from */
+	uint8_t *unused;
+	size_t unused_count;
+	/* The number of nodes in the next block allocated for the class */
+	size_t block_node_count;
+};
+
+struct Node_Pool {
+	struct Btree_Allocator allocator;
+	/* The number of btrees and merged pools referring to this pool */
+	size_t reference_count;
+	/* The pool this one was merged into, or NULL */
+	struct Node_Pool *parent;
+	/* The blocks of all size classes, which only the root pool has */
+	struct Pool_Block *blocks;
+	struct Size_Class classes[POOL_CLASS_COUNT];
+};
+
+static void *
+default_alloc(void *context, size_t size, size_t alignment)
+{
+	(void) context;
+	if (alignment <= alignof(max_align_t))
+		return xmalloc(size);
+	return xaligned_alloc(alignment, size);
+}
+
+static void
+default_free(void *context, void *ptr, size_t size)
+{
+	(void) context;
+	(void) size;
+	free(ptr);
+}
+
+/*
+ * Rounds `size` up to a multiple of `alignment`
+ */
+static size_t
+align_size(size_t size, size_t alignment)
+{
+	return (size + alignment - 1) / alignment * alignment;
+}
+
+/*
+ * Creates a pool for leaves of `leaf_size` bytes and branches of
+ * `branch_size` bytes, referred to by a single btree.  Nodes are aligned to
+ * `leaf_alignment` and `branch_alignment`, or to the alignment of the
+ * allocator if it is larger.  Memory is taken from `allocator`, or from malloc
+ * if it is NULL.  Returns NULL if the pool can't be allocated.
+ */
+struct Node_Pool *
+pool_new(const struct Btree_Allocator *allocator, size_t leaf_size, size_t leaf_alignment, size_t branch_size, size_t branch_alignment)
+{
+	struct Btree_Allocator pool_allocator = { default_alloc, default_free, NULL, 0 };
+	if (allocator != NULL)
+		pool_allocator = *allocator;
+
+	struct Node_Pool *pool = pool_allocator.alloc(pool_allocator.context, sizeof(struct Node_Pool), alignof(struct Node_Pool));
+	if (pool == NULL)
+		return NULL;
+	pool->allocator = pool_allocator;
+	pool->reference_count = 1;
+	pool->parent = NULL;
+	pool->blocks = NULL;
+	size_t sizes[POOL_CLASS_COUNT] = { [POOL_LEAF] = leaf_size, [POOL_BRANCH] = branch_size };
+	size_t alignments[POOL_CLASS_COUNT] = { [POOL_LEAF] = leaf_alignment, [POOL_BRANCH] = branch_alignment };
+	for (size_t i = 0; i < POOL_CLASS_COUNT; i++) {
+		struct Size_Class *class = &pool->classes[i];
+		class->alignment = alignof(max_align_t);
+		if (class->alignment < alignments[i])
+			class->alignment = alignments[i];
+		if (class->alignment < pool_allocator.alignment)
+			class->alignment = pool_allocator.alignment;
+		class->node_size = align_size(sizes[i], class->alignment);
+		class->free_list = NULL;
+		class->free_count = 0;
+		class->unused = NULL;
+		class->unused_count = 0;
+		class->block_node_count = FIRST_BLOCK_NODE_COUNT;
+	}
+	return pool;
+}
+
+/*
+ * Creates an empty pool with the same allocator and size classes as another,
+ * referred to by a single btree.  Returns NULL if the pool can't be allocated.
+ */
+struct Node_Pool *
+pool_new_like(const struct Node_Pool *pool)
+{
+	struct Node_Pool *new_pool = pool->allocator.alloc(pool->allocator.context, sizeof(struct Node_Pool), alignof(struct Node_Pool));
+	if (new_pool == NULL)
+		return NULL;
+	new_pool->allocator = pool->allocator;
+	new_pool->reference_count = 1;
+	new_pool->parent = NULL;
+	new_pool->blocks = NULL;
+	for (size_t i = 0; i < POOL_CLASS_COUNT; i++) {
+		struct Size_Class *class = &new_pool->classes[i];
+		class->node_size = pool->classes[i].node_size;
+		class->alignment = pool->classes[i].alignment;
+		class->free_list = NULL;
+		class->free_count = 0;
+		class->unused = NULL;
+		class->unused_count = 0;
+		class->block_node_count = FIRST_BLOCK_NODE_COUNT;
+	}
+	return new_pool;
+}
+
+/*
+ * Returns the pool that a pool was merged into, directly or not, which owns
+ * its blocks
+ */
+static struct Node_Pool *
+get_root(struct Node_Pool *pool)
+{
+	while (pool->parent != NULL)
+		pool = pool->parent;
+	return pool;
+}
+
+/*
+ * Adds a reference to a pool for another btree to allocate from, and returns
+ * the pool
+ */
+struct Node_Pool *
+pool_share(struct Node_Pool *pool)
+{
+	pool->reference_count++;
+	return pool;
+}
+
+/*
+ * Merges the pool `b` into the pool `a`, so that nodes allocated from either
+ * of them can be freed to either of them.  Both of them remain valid for the
+ * btrees referring to them.  The pools must have the same allocator.
+ */
+void
+pool_merge(struct Node_Pool *a, struct Node_Pool *b)
+{
+	a = get_root(a);
+	b = get_root(b);
+	if (a == b)
+		return;
+	b->parent = a;
+	a->reference_count++;
+
+	if (b->blocks != NULL) {
+		struct Pool_Block *last = b->blocks;
+		while (last->next != NULL)
+			last = last->next;
+		last->next = a->blocks;
+		a->blocks = b->blocks;
+		b->blocks = NULL;
+	}
+
+	/* The nodes that `b` could still have handed out go to `a` */
+	for (size_t i = 0; i < POOL_CLASS_COUNT; i++) {
+		struct Size_Class *class = &b->classes[i];
+		while (class->free_list != NULL) {
+			struct Free_Node *node = class->free_list;
+			class->free_list = node->next;
+			pool_free(a, i, node);
+		}
+		for (; class->unused_count > 0; class->unused_count--) {
+			pool_free(a, i, class->unused);
+			class->unused += class->node_size;
+		}
+		class->free_count = 0;
+		if (a->classes[i].block_node_count < class->block_node_count)
+			a->classes[i].block_node_count = class->block_node_count;
+	}
+}
+
+/*
+ * Returns true if anything other than the single btree referring to a pool
+ * may be using its nodes, in which case the nodes of the btree must be freed
+ * one by one instead of with the pool
+ */
+bool
+pool_is_shared(const struct Node_Pool *pool)
+{
+	for (; pool != NULL; pool = pool->parent) {
+		if (pool->reference_count > 1)
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Drops a reference to a pool.  A pool without references is freed, along with
+ * its blocks and every node in them, and drops its reference to the pool it
+ * was merged into.
+ */
+void
+pool_release(struct Node_Pool *pool)
+{
+	while (pool != NULL && --pool->reference_count == 0) {
+		struct Node_Pool *parent = pool->parent;
+		struct Btree_Allocator allocator = pool->allocator;
+		while (pool->blocks != NULL) {
+			struct Pool_Block *block = pool->blocks;
+			pool->blocks = block->next;
+			allocator.free(allocator.context, (uint8_t *) (block + 1) - block->size, block->size);
+		}
+		allocator.free(allocator.context, pool, sizeof(struct Node_Pool));
+		pool = parent;
+	}
+}
+
+/*
+ * Allocates a new block for a size class of the root pool `pool`.  Returns
+ * false if it can't be allocated.
+ */
+static bool
+add_block(struct Node_Pool *pool, struct Size_Class *class)
+{
+	size_t nodes_size = class->block_node_count * class->node_size;
+	size_t size = nodes_size + sizeof(struct Pool_Block);
+	uint8_t *data = pool->allocator.alloc(pool->allocator.context, size, class->alignment);
+	if (data == NULL)
+		return false;
+	struct Pool_Block *block = (struct Pool_Block *) (data + nodes_size);
+	block->next = pool->blocks;
+	block->size = size;
+	pool->blocks = block;
+
+	/* Whatever was left of the previous block goes to the free list */
+	for (; class->unused_count > 0; class->unused_count--) {
+		pool_free(pool, class - pool->classes, class->unused);
+		class->unused += class->node_size;
+	}
+	class->unused = data;
+	class->unused_count = class->block_node_count;
+	if (nodes_size < MAX_BLOCK_SIZE)
+		class->block_node_count *= 2;
+	return true;
+}
+
+/*
+ * Returns true if allocating from a pool can fail.  Pools using malloc exit the
+ * process instead.
+ */
+bool
+pool_can_fail(const struct Node_Pool *pool)
+{
+	return pool->allocator.alloc != default_alloc;
+}
+
+/*
+ * Returns the allocator of a pool, for memory that outlives the pool
+ */
+const struct Btree_Allocator *
+pool_get_allocator(const struct Node_Pool *pool)
+{
+	return &pool->allocator;
+}
+
+/*
+ * Returns true if nodes of one of two pools can be freed to the other, which
+ * requires the same allocator and node sizes
+ */
+bool
+pool_is_compatible(const struct Node_Pool *a, const struct Node_Pool *b)
+{
+	if (a->allocator.alloc != b->allocator.alloc || a->allocator.free != b->allocator.free || a->allocator.context != b->allocator.context)
+		return false;
+	for (size_t i = 0; i < POOL_CLASS_COUNT; i++) {
+		if (a->classes[i].node_size != b->classes[i].node_size || a->classes[i].alignment != b->classes[i].alignment)
+			return false;
+	}
+	return true;
+}
+
+/*
+ * Makes sure that `count`-many nodes of a size class can be allocated from a
+ * pool without failing.  Returns false if the memory for them can't be
+ * allocated.  Nothing is set aside for pools that can't fail.
+ */
+bool
+pool_reserve(struct Node_Pool *pool, enum Pool_Class class_index, size_t count)
+{
+	pool = get_root(pool);
+	if (!pool_can_fail(pool))
+		return true;
+	struct Size_Class *class = &pool->classes[class_index];
+	while (class->free_count + class->unused_count < count) {
+		if (!add_block(pool, class))
+			return false;
+	}
+	return true;
+}
+
+/*
+ * Allocates a node of a size class from a pool, reusing a freed node if there
+ * is one.  Returns NULL if the node can't be allocated, which can only happen
+ * if fewer nodes were reserved.
+ */
+void *
+pool_alloc(struct Node_Pool *pool, enum Pool_Class class_index)
+{
+	pool = get_root(pool);
+	struct Size_Class *class = &pool->classes[class_index];
+	if (class->free_list != NULL) {
+		struct Free_Node *node = class->free_list;
+		class->free_list = node->next;
+		class->free_count--;
+		return node;
+	}
+
+	if (class->unused_count == 0 && !add_block(pool, class))
+		return NULL;
+	void *node = class->unused;
+	class->unused += class->node_size;
+	class->unused_count--;
+	return node;
+}
+
+/*
+ * Returns a node of a size class to a pool for reuse
+ */
+void
+pool_free(struct Node_Pool *pool, enum Pool_Class class_index, void *ptr)
+{
+	struct Size_Class *class = &get_root(pool)->classes[class_index];
+	struct Free_Node *node = ptr;
+	node->next = class->free_list;
+	class->free_list = node;
+	class->free_count++;
+}
+
+/*
+ * Allocates `size` bytes for something other than a node, such as a btree
+ * structure, with the allocator of a pool.  Returns NULL if they can't be
+ * allocated.
+ */
+void *
+pool_alloc_object(struct Node_Pool *pool, size_t size)
+{
+	return pool->allocator.alloc(pool->allocator.context, size, alignof(max_align_t));
+}
+
+/*
+ * Frees memory allocated with `pool_alloc_object`
+ */
+void
+pool_free_object(struct Node_Pool *pool, void *ptr, size_t size)
+{
+	pool->allocator.free(pool->allocator.context, ptr, size);
+}
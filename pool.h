@@ -0,0 +1,35 @@
+#ifndef _POOL_H
+#define _POOL_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "btree.h"
+
+/*
+ * The size classes of a node pool
+ */
+enum Pool_Class {
+	POOL_LEAF,
+	POOL_BRANCH,
+	POOL_CLASS_COUNT,
+};
+
+struct Node_Pool;
+
+struct Node_Pool *pool_new(const struct Btree_Allocator *, size_t, size_t, size_t, size_t);
+struct Node_Pool *pool_new_like(const struct Node_Pool *);
+struct Node_Pool *pool_share(struct Node_Pool *);
+void pool_merge(struct Node_Pool *, struct Node_Pool *);
+bool pool_is_shared(const struct Node_Pool *);
+bool pool_can_fail(const struct Node_Pool *);
+const struct Btree_Allocator *pool_get_allocator(const struct Node_Pool *);
+bool pool_is_compatible(const struct Node_Pool *, const struct Node_Pool *);
+void pool_release(struct Node_Pool *);
+bool pool_reserve(struct Node_Pool *, enum Pool_Class, size_t);
+void *pool_alloc(struct Node_Pool *, enum Pool_Class);
+void pool_free(struct Node_Pool *, enum Pool_Class, void *);
+void *pool_alloc_object(struct Node_Pool *, size_t);
+void pool_free_object(struct Node_Pool *, void *, size_t);
+
+#endif
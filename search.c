@@ -0,0 +1,557 @@
+/*
+ * Search kernels for btrees with built-in integer key types.  These compare
+ * keys directly instead of through a comparison callback, and, where the keys
+ * are packed together, count many keys per instruction with AVX2 or SSE
+ * instructions chosen at runtime.  Also holds the scan of per-child entry
+ * counts, and the built-in comparison functions, which btrees recognize as
+ * their key types.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "search.h"
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define SEARCH_X86
+#include <immintrin.h>
+#endif
+
+/*
+ * The number of bytes of packed keys below which a search stops halving its
+ * range and counts the remaining keys linearly
+ */
+#define LINEAR_SEARCH_BYTES 256
+
+/*
+ * Defines a comparison function for an integer key type, following the
+ * convention of `Btree_Compare`
+ */
+#define DEFINE_KEY_COMPARE(name, type) \
+static inline int \
+name##_keys(const void *a_ptr, const void *b_ptr) \
+{ \
+	type a, b; \
+	memcpy(&a, a_ptr, sizeof(type)); \
+	memcpy(&b, b_ptr, sizeof(type)); \
+	return (b > a) - (b < a); \
+} \
+\
+int \
+name(const void *a_ptr, const void *b_ptr, const void *data) \
+{ \
+	(void) data; \
+	return name##_keys(a_ptr, b_ptr); \
+}
+
+DEFINE_KEY_COMPARE(btree_compare_u32, uint32_t)
+DEFINE_KEY_COMPARE(btree_compare_i32, int32_t)
+DEFINE_KEY_COMPARE(btree_compare_u64, uint64_t)
+DEFINE_KEY_COMPARE(btree_compare_i64, int64_t)
+
+static inline int
+compare_string_keys(const void *a_ptr, const void *b_ptr)
+{
+	const char *a, *b;
+	memcpy(&a, a_ptr, sizeof(const char *));
+	memcpy(&b, b_ptr, sizeof(const char *));
+	int comparison = strcmp(b, a);
+	return (comparison > 0) - (comparison < 0);
+}
+
+/*
+ * Compares two keys that are pointers to strings, bytewise
+ */
+int
+btree_compare_string(const void *a_ptr, const void *b_ptr, const void *data)
+{
+	(void) data;
+	return compare_string_keys(a_ptr, b_ptr);
+}
+
+/*
+ * Compares a field of two composite keys
+ */
+static inline int
+compare_field(const struct Btree_Key_Field *restrict field, const uint8_t *restrict a, const uint8_t *restrict b)
+{
+	a += field->offset;
+	b += field->offset;
+	int comparison = 0;
+	switch (field->type) {
+	case BTREE_FIELD_U32:
+		comparison = btree_compare_u32_keys(a, b);
+		break;
+	case BTREE_FIELD_I32:
+		comparison = btree_compare_i32_keys(a, b);
+		break;
+	case BTREE_FIELD_U64:
+		comparison = btree_compare_u64_keys(a, b);
+		break;
+	case BTREE_FIELD_I64:
+		comparison = btree_compare_i64_keys(a, b);
+		break;
+	case BTREE_FIELD_STRING:
+		comparison = compare_string_keys(a, b);
+		break;
+	case BTREE_FIELD_BYTES:
+		comparison = memcmp(b, a, field->size);
+		comparison = (comparison > 0) - (comparison < 0);
+		break;
+	}
+	return field->descending ? -comparison : comparison;
+}
+
+/*
+ * Compares two composite keys field by field.  `data` points to the `struct
+ * Btree_Key_Fields` describing them.
+ */
+int
+btree_compare_fields(const void *a, const void *b, const void *data)
+{
+	const struct Btree_Key_Fields *fields = data;
+	for (size_t i = 0; i < fields->count; i++) {
+		int comparison = compare_field(&fields->fields[i], a, b);
+		if (comparison != 0)
+			return comparison;
+	}
+	return 0;
+}
+
+/*
+ * Reads up to 8 bytes, stopping early at a NUL byte if `string` is true, into
+ * the high end of a number, so that numbers are ordered like the bytes are
+ */
+static uint64_t
+normalize_bytes(const uint8_t *bytes, size_t size, bool string)
+{
+	uint64_t normalized = 0;
+	for (size_t i = 0; i < size && i < sizeof(uint64_t); i++) {
+		if (string && bytes[i] == '\0')
+			break;
+		normalized |= (uint64_t) bytes[i] << (56 - i * 8);
+	}
+	return normalized;
+}
+
+/*
+ * Normalizes a composite key by its first field.  Keys ordered by their first
+ * field are ordered by its normalized value, and the other fields only break
+ * ties.
+ */
+static uint64_t
+normalize_fields(const void *key, const void *data)
+{
+	const struct Btree_Key_Fields *fields = data;
+	if (fields->count == 0)
+		return 0;
+	const struct Btree_Key_Field *field = &fields->fields[0];
+	const uint8_t *bytes = (const uint8_t *) key + field->offset;
+	uint64_t normalized = 0;
+	switch (field->type) {
+	case BTREE_FIELD_U32: {
+		uint32_t value;
+		memcpy(&value, bytes, sizeof(uint32_t));
+		normalized = value;
+		break;
+	}
+	case BTREE_FIELD_I32: {
+		uint32_t value;
+		memcpy(&value, bytes, sizeof(uint32_t));
+		normalized = value ^ UINT32_C(1) << 31;
+		break;
+	}
+	case BTREE_FIELD_U64:
+		memcpy(&normalized, bytes, sizeof(uint64_t));
+		break;
+	case BTREE_FIELD_I64:
+		memcpy(&normalized, bytes, sizeof(uint64_t));
+		normalized ^= UINT64_C(1) << 63;
+		break;
+	case BTREE_FIELD_STRING: {
+		const char *string;
+		memcpy(&string, bytes, sizeof(const char *));
+		normalized = normalize_bytes((const uint8_t *) string, sizeof(uint64_t), true);
+		break;
+	}
+	case BTREE_FIELD_BYTES:
+		normalized = normalize_bytes(bytes, field->size, false);
+		break;
+	}
+	return field->descending ? ~normalized : normalized;
+}
+
+/*
+ * Defines a binary search for an integer key type, which works with any
+ * stride
+ */
+#define DEFINE_SCALAR_SEARCH(name, type) \
+static size_t \
+name(const void *keys, size_t stride, size_t count, const void *target_ptr, bool upper) \
+{ \
+	type target; \
+	memcpy(&target, target_ptr, sizeof(type)); \
+	size_t low = 0; \
+	size_t high = count; \
+	while (low != high) { \
+		size_t middle = (low + high) / 2; \
+		type key; \
+		memcpy(&key, (const uint8_t *) keys + middle * stride, sizeof(type)); \
+		if (key < target || (upper && key == target)) \
+			low = middle + 1; \
+		else \
+			high = middle; \
+	} \
+	return low; \
+}
+
+DEFINE_SCALAR_SEARCH(search_u32, uint32_t)
+DEFINE_SCALAR_SEARCH(search_i32, int32_t)
+DEFINE_SCALAR_SEARCH(search_u64, uint64_t)
+DEFINE_SCALAR_SEARCH(search_i64, int64_t)
+
+static size_t
+scan_counts(const size_t *counts, size_t count, size_t *index)
+{
+	size_t i = 0;
+	while (i < count && counts[i] <= *index)
+		*index -= counts[i++];
+	return i;
+}
+
+#ifdef SEARCH_X86
+
+/*
+ * Halves the range of packed keys being searched until it is small enough to
+ * be counted linearly.  Sets `*low` to the start of the remaining range and
+ * returns its length.  Keys are compared after being XORed with `bias`, which
+ * makes unsigned keys compare correctly as signed ones.
+ */
+static inline size_t
+narrow_64(const uint64_t *keys, size_t count, int64_t target, bool upper, uint64_t bias, size_t *low)
+{
+	*low = 0;
+	while (count > LINEAR_SEARCH_BYTES / sizeof(uint64_t)) {
+		size_t half = count / 2;
+		int64_t key = (int64_t) (keys[*low + half] ^ bias);
+		if (key < target || (upper && key == target)) {
+			*low += half + 1;
+			count -= half + 1;
+		} else {
+			count = half;
+		}
+	}
+	return count;
+}
+
+static inline size_t
+narrow_32(const uint32_t *keys, size_t count, int32_t target, bool upper, uint32_t bias, size_t *low)
+{
+	*low = 0;
+	while (count > LINEAR_SEARCH_BYTES / sizeof(uint32_t)) {
+		size_t half = count / 2;
+		int32_t key = (int32_t) (keys[*low + half] ^ bias);
+		if (key < target || (upper && key == target)) {
+			*low += half + 1;
+			count -= half + 1;
+		} else {
+			count = half;
+		}
+	}
+	return count;
+}
+
+/*
+ * Counts 64-bit keys with AVX2.  Keys that come before the target are counted
+ * by comparing the target with each key.  For `upper`, the keys that come
+ * after the target are counted instead and subtracted from the total.
+ */
+__attribute__((target("avx2")))
+static size_t
+search_64_avx2(const void *keys_ptr, size_t count, const void *target_ptr, bool upper, uint64_t bias)
+{
+	const uint64_t *keys = keys_ptr;
+	uint64_t raw_target;
+	memcpy(&raw_target, target_ptr, sizeof(uint64_t));
+	int64_t target = (int64_t) (raw_target ^ bias);
+	size_t low;
+	count = narrow_64(keys, count, target, upper, bias, &low);
+	keys += low;
+
+	__m256i target_vector = _mm256_set1_epi64x(target);
+	__m256i bias_vector = _mm256_set1_epi64x((int64_t) bias);
+	size_t counted = 0;
+	size_t i = 0;
+	for (; i + 4 <= count; i += 4) {
+		__m256i key_vector = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *) (keys + i)), bias_vector);
+		__m256i mask = upper ? _mm256_cmpgt_epi64(key_vector, target_vector) : _mm256_cmpgt_epi64(target_vector, key_vector);
+		counted += __builtin_popcount(_mm256_movemask_pd(_mm256_castsi256_pd(mask)));
+	}
+	for (; i < count; i++) {
+		int64_t key = (int64_t) (keys[i] ^ bias);
+		counted += upper ? key > target : key < target;
+	}
+	return low + (upper ? count - counted : counted);
+}
+
+__attribute__((target("sse4.2")))
+static size_t
+search_64_sse(const void *keys_ptr, size_t count, const void *target_ptr, bool upper, uint64_t bias)
+{
+	const uint64_t *keys = keys_ptr;
+	uint64_t raw_target;
+	memcpy(&raw_target, target_ptr, sizeof(uint64_t));
+	int64_t target = (int64_t) (raw_target ^ bias);
+	size_t low;
+	count = narrow_64(keys, count, target, upper, bias, &low);
+	keys += low;
+
+	__m128i target_vector = _mm_set1_epi64x(target);
+	__m128i bias_vector = _mm_set1_epi64x((int64_t) bias);
+	size_t counted = 0;
+	size_t i = 0;
+	for (; i + 2 <= count; i += 2) {
+		__m128i key_vector = _mm_xor_si128(_mm_loadu_si128((const __m128i *) (keys + i)), bias_vector);
+		__m128i mask = upper ? _mm_cmpgt_epi64(key_vector, target_vector) : _mm_cmpgt_epi64(target_vector, key_vector);
+		counted += __builtin_popcount(_mm_movemask_pd(_mm_castsi128_pd(mask)));
+	}
+	for (; i < count; i++) {
+		int64_t key = (int64_t) (keys[i] ^ bias);
+		counted += upper ? key > target : key < target;
+	}
+	return low + (upper ? count - counted : counted);
+}
+
+__attribute__((target("avx2")))
+static size_t
+search_32_avx2(const void *keys_ptr, size_t count, const void *target_ptr, bool upper, uint32_t bias)
+{
+	const uint32_t *keys = keys_ptr;
+	uint32_t raw_target;
+	memcpy(&raw_target, target_ptr, sizeof(uint32_t));
+	int32_t target = (int32_t) (raw_target ^ bias);
+	size_t low;
+	count = narrow_32(keys, count, target, upper, bias, &low);
+	keys += low;
+
+	__m256i target_vector = _mm256_set1_epi32(target);
+	__m256i bias_vector = _mm256_set1_epi32((int32_t) bias);
+	size_t counted = 0;
+	size_t i = 0;
+	for (; i + 8 <= count; i += 8) {
+		__m256i key_vector = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *) (keys + i)), bias_vector);
+		__m256i mask = upper ? _mm256_cmpgt_epi32(key_vector, target_vector) : _mm256_cmpgt_epi32(target_vector, key_vector);
+		counted += __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(mask)));
+	}
+	for (; i < count; i++) {
+		int32_t key = (int32_t) (keys[i] ^ bias);
+		counted += upper ? key > target : key < target;
+	}
+	return low + (upper ? count - counted : counted);
+}
+
+/* SSE2 is part of x86-64, so this needs no runtime check */
+static size_t
+search_32_sse(const void *keys_ptr, size_t count, const void *target_ptr, bool upper, uint32_t bias)
+{
+	const uint32_t *keys = keys_ptr;
+	uint32_t raw_target;
+	memcpy(&raw_target, target_ptr, sizeof(uint32_t));
+	int32_t target = (int32_t) (raw_target ^ bias);
+	size_t low;
+	count = narrow_32(keys, count, target, upper, bias, &low);
+	keys += low;
+
+	__m128i target_vector = _mm_set1_epi32(target);
+	__m128i bias_vector = _mm_set1_epi32((int32_t) bias);
+	size_t counted = 0;
+	size_t i = 0;
+	for (; i + 4 <= count; i += 4) {
+		__m128i key_vector = _mm_xor_si128(_mm_loadu_si128((const __m128i *) (keys + i)), bias_vector);
+		__m128i mask = upper ? _mm_cmpgt_epi32(key_vector, target_vector) : _mm_cmpgt_epi32(target_vector, key_vector);
+		counted += __builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(mask)));
+	}
+	for (; i < count; i++) {
+		int32_t key = (int32_t) (keys[i] ^ bias);
+		counted += upper ? key > target : key < target;
+	}
+	return low + (upper ? count - counted : counted);
+}
+
+/*
+ * Wrappers with the `Key_Search` signature for packed keys, which pass on the
+ * bias for each key type
+ */
+#define DEFINE_PACKED_SEARCH(name, kernel, bias) \
+static size_t \
+name(const void *keys, size_t stride, size_t count, const void *target, bool upper) \
+{ \
+	(void) stride; \
+	return kernel(keys, count, target, upper, bias); \
+}
+
+DEFINE_PACKED_SEARCH(search_u32_avx2, search_32_avx2, UINT32_C(1) << 31)
+DEFINE_PACKED_SEARCH(search_u32_sse, search_32_sse, UINT32_C(1) << 31)
+DEFINE_PACKED_SEARCH(search_i32_avx2, search_32_avx2, 0)
+DEFINE_PACKED_SEARCH(search_i32_sse, search_32_sse, 0)
+DEFINE_PACKED_SEARCH(search_u64_avx2, search_64_avx2, UINT64_C(1) << 63)
+DEFINE_PACKED_SEARCH(search_u64_sse, search_64_sse, UINT64_C(1) << 63)
+DEFINE_PACKED_SEARCH(search_i64_avx2, search_64_avx2, 0)
+DEFINE_PACKED_SEARCH(search_i64_sse, search_64_sse, 0)
+
+/*
+ * Scans entry counts four at a time with AVX2.  The counts in a vector are
+ * summed with the ones before them in two shifted additions, and the sums
+ * are compared with what is left of the index all at once.  Counts are far
+ * below 2^63, so signed comparisons work for them.
+ */
+__attribute__((target("avx2")))
+static size_t
+scan_counts_avx2(const size_t *counts, size_t count, size_t *index)
+{
+	__m256i zero = _mm256_setzero_si256();
+	__m256i index_vector = _mm256_set1_epi64x((int64_t) *index);
+	size_t i = 0;
+	for (; i + 4 <= count; i += 4) {
+		__m256i sums = _mm256_loadu_si256((const __m256i *) (counts + i));
+		sums = _mm256_add_epi64(sums, _mm256_blend_epi32(_mm256_permute4x64_epi64(sums, _MM_SHUFFLE(2, 1, 0, 0)), zero, 0x03));
+		sums = _mm256_add_epi64(sums, _mm256_blend_epi32(_mm256_permute4x64_epi64(sums, _MM_SHUFFLE(1, 0, 0, 0)), zero, 0x0f));
+		int mask = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(sums, index_vector)));
+		if (mask != 0) {
+			size_t found = __builtin_ctz(mask);
+			uint64_t sum_array[4];
+			_mm256_storeu_si256((__m256i *) sum_array, sums);
+			*index = (size_t) _mm256_extract_epi64(index_vector, 0) - (found > 0 ? sum_array[found - 1] : 0);
+			return i + found;
+		}
+		index_vector = _mm256_sub_epi64(index_vector, _mm256_permute4x64_epi64(sums, _MM_SHUFFLE(3, 3, 3, 3)));
+	}
+	*index = (size_t) _mm256_extract_epi64(index_vector, 0);
+	return i + scan_counts(counts + i, count - i, index);
+}
+
+#endif
+
+/*
+ * Returns the search function for keys of a built-in type spaced `stride`
+ * bytes apart, using the vector instructions supported by the CPU if the keys
+ * are packed together.  Returns NULL for custom keys.
+ */
+Key_Search *
+get_key_search(enum Btree_Key_Type key_type, size_t stride)
+{
+	switch (key_type) {
+	case BTREE_KEY_U32:
+#ifdef SEARCH_X86
+		if (stride == sizeof(uint32_t))
+			return __builtin_cpu_supports("avx2") ? search_u32_avx2 : search_u32_sse;
+#endif
+		return search_u32;
+	case BTREE_KEY_I32:
+#ifdef SEARCH_X86
+		if (stride == sizeof(int32_t))
+			return __builtin_cpu_supports("avx2") ? search_i32_avx2 : search_i32_sse;
+#endif
+		return search_i32;
+	case BTREE_KEY_U64:
+#ifdef SEARCH_X86
+		if (stride == sizeof(uint64_t) && __builtin_cpu_supports("avx2"))
+			return search_u64_avx2;
+		if (stride == sizeof(uint64_t) && __builtin_cpu_supports("sse4.2"))
+			return search_u64_sse;
+#endif
+		return search_u64;
+	case BTREE_KEY_I64:
+#ifdef SEARCH_X86
+		if (stride == sizeof(int64_t) && __builtin_cpu_supports("avx2"))
+			return search_i64_avx2;
+		if (stride == sizeof(int64_t) && __builtin_cpu_supports("sse4.2"))
+			return search_i64_sse;
+#endif
+		return search_i64;
+	default:
+		return NULL;
+	}
+}
+
+/*
+ * Returns the scan of per-child entry counts, using AVX2 if the CPU supports
+ * it
+ */
+Count_Scan *
+get_count_scan(void)
+{
+#ifdef SEARCH_X86
+	if (__builtin_cpu_supports("avx2"))
+		return scan_counts_avx2;
+#endif
+	return scan_counts;
+}
+
+/*
+ * Returns the size of a key of a built-in type, or 0 for custom keys
+ */
+size_t
+get_key_type_size(enum Btree_Key_Type key_type)
+{
+	switch (key_type) {
+	case BTREE_KEY_U32:
+		return sizeof(uint32_t);
+	case BTREE_KEY_I32:
+		return sizeof(int32_t);
+	case BTREE_KEY_U64:
+		return sizeof(uint64_t);
+	case BTREE_KEY_I64:
+		return sizeof(int64_t);
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Returns the comparison function ordering entries by a key of a built-in
+ * type in ascending order, or NULL for custom keys
+ */
+Btree_Compare *
+get_key_compare(enum Btree_Key_Type key_type)
+{
+	switch (key_type) {
+	case BTREE_KEY_U32:
+		return btree_compare_u32;
+	case BTREE_KEY_I32:
+		return btree_compare_i32;
+	case BTREE_KEY_U64:
+		return btree_compare_u64;
+	case BTREE_KEY_I64:
+		return btree_compare_i64;
+	case BTREE_KEY_STRING:
+		return btree_compare_string;
+	default:
+		return NULL;
+	}
+}
+
+/*
+ * Returns the key type that a comparison function is the built-in comparison
+ * function of, or `BTREE_KEY_CUSTOM` if it isn't one
+ */
+enum Btree_Key_Type
+get_compare_key_type(Btree_Compare *compare)
+{
+	static const enum Btree_Key_Type key_types[] = { BTREE_KEY_U32, BTREE_KEY_I32, BTREE_KEY_U64, BTREE_KEY_I64, BTREE_KEY_STRING };
+	for (size_t i = 0; i < sizeof(key_types) / sizeof(key_types[0]); i++) {
+		if (compare == get_key_compare(key_types[i]))
+			return key_types[i];
+	}
+	return BTREE_KEY_CUSTOM;
+}
+
+/*
+ * Returns the normalization function of a built-in comparison function of
+ * custom keys, or NULL if it has none
+ */
+Btree_Normalize *
+get_compare_normalize(Btree_Compare *compare)
+{
+	return compare == btree_compare_fields ? normalize_fields : NULL;
+}
@@ -0,0 +1,30 @@
+#ifndef _SEARCH_H
+#define _SEARCH_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "btree.h"
+
+/*
+ * Searches `count`-many sorted keys, spaced `stride` bytes apart, for `target`.
+ * Returns the number of keys that come before the target, or, if `upper` is
+ * true, that do not come after it.
+ */
+typedef size_t Key_Search(const void *keys, size_t stride, size_t count, const void *target, bool upper);
+
+/*
+ * Scans `count`-many entry counts for the first one whose sum with the counts
+ * before it exceeds `*index`, and subtracts the counts before it from `*index`.
+ * Returns its position, or `count` if there is none.
+ */
+typedef size_t Count_Scan(const size_t *counts, size_t count, size_t *index);
+
+Key_Search *get_key_search(enum Btree_Key_Type, size_t);
+Count_Scan *get_count_scan(void);
+size_t get_key_type_size(enum Btree_Key_Type);
+Btree_Compare *get_key_compare(enum Btree_Key_Type);
+enum Btree_Key_Type get_compare_key_type(Btree_Compare *);
+Btree_Normalize *get_compare_normalize(Btree_Compare *);
+
+#endif
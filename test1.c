@@ -5,15 +5,6 @@
 
 #include "test_data/numbers.h"
 
-static int
-compare(const void *void_a, const void *void_b, const void *data)
-{
-	(void) data;
-	const uint64_t *a = void_a;
-	const uint64_t *b = void_b;
-	return *b - *a;
-}
-
 static void
 display(const void *entry)
 {
@@ -37,10 +28,10 @@ main(int argc, char **argv)
 		return EXIT_FAILURE;
 	}
 
-	struct Btree *btree = btree_new(branch_size, leaf_size, sizeof(uint64_t), compare, NULL);
+	struct Btree *btree = btree_new(branch_size, leaf_size, sizeof(uint64_t), btree_compare_u64, NULL);
 	for (size_t i = 0; i < count; i++) {
 		uint64_t nr = (test_numbers[i >> 16] << 16) + test_numbers[i % ((size_t) 1 << 16)];
-		btree_insert(btree, &nr);
+		btree_insert(btree, &nr, NULL);
 	}
 
 	if (argc != 5)
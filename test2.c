@@ -45,7 +45,7 @@ main(int argc, char **argv)
 
 	struct Btree *btree = btree_new(branch_size, leaf_size, sizeof(struct Person), compare, NULL);
 	for (size_t i = 0; i < count; i++)
-		btree_insert(btree, &test_people[i]);
+		btree_insert(btree, &test_people[i], NULL);
 
 	btree_display(btree, display);
 
@@ -57,5 +57,14 @@ main(int argc, char **argv)
 		printf("    (%lu contiguous)\n", count);
 	}
 
+	for (size_t i = 0; i < count; i++) {
+		size_t index, contiguous;
+		const struct Person *person = btree_find(btree, &test_people[i], &index, &contiguous);
+		if (person == NULL || strcmp(person->name, test_people[i].name) != 0)
+			die("btree_find did not find an inserted entry");
+		if (btree_fetch(btree, index, &contiguous) != person)
+			die("btree_find returned an index that does not match btree_fetch");
+	}
+
 	btree_free(btree);
 }
@@ -0,0 +1,819 @@
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "util.h"
+#include "btree.h"
+
+#include "test_data/numbers.h"
+
+static int
+compare(const void *void_a, const void *void_b, const void *data)
+{
+	(void) data;
+	const uint64_t *a = void_a;
+	const uint64_t *b = void_b;
+	return (*b > *a) - (*b < *a);
+}
+
+static void
+display(const void *entry)
+{
+	const uint64_t *num = entry;
+	printf("%lu", *num);
+}
+
+static uint64_t
+get_number(size_t i)
+{
+	return ((uint64_t) test_numbers[i >> 16] << 16) + test_numbers[i % ((size_t) 1 << 16)];
+}
+
+/*
+ * Checks that the entries of the btree are in order, and that each of them
+ * can be found at the index it was fetched from
+ */
+static void
+check(const struct Btree *btree, size_t count)
+{
+	const uint64_t *previous = NULL;
+	for (size_t i = 0; i < count; i++) {
+		size_t contiguous;
+		const uint64_t *nr = btree_fetch(btree, i, &contiguous);
+		if (previous != NULL && compare(previous, nr, NULL) <= 0)
+			die("Entries are out of order");
+
+		size_t index;
+		if (btree_find(btree, nr, &index, &contiguous) != nr || index != i)
+			die("btree_find does not match btree_fetch");
+		if (btree_rank(btree, nr) != i)
+			die("btree_rank does not match btree_fetch");
+		if (previous != NULL && btree_count_range(btree, previous, nr) != 1)
+			die("btree_count_range does not count a single entry");
+		if (btree_count_range(btree, nr, nr) != 0)
+			die("btree_count_range does not count an empty range");
+		previous = nr;
+	}
+
+	struct Btree_Cursor cursor;
+	size_t i = 0;
+	for (const uint64_t *nr = btree_cursor_first(&cursor, btree); nr != NULL; nr = btree_cursor_next(&cursor)) {
+		size_t contiguous;
+		if (btree_cursor_index(&cursor) != i || nr != btree_fetch(btree, i, &contiguous))
+			die("Iterating forwards with a cursor does not match btree_fetch");
+		i++;
+	}
+	if (i != count)
+		die("Iterating forwards with a cursor skipped entries");
+	for (const uint64_t *nr = btree_cursor_last(&cursor, btree); nr != NULL; nr = btree_cursor_prev(&cursor)) {
+		size_t contiguous;
+		i--;
+		if (btree_cursor_index(&cursor) != i || nr != btree_fetch(btree, i, &contiguous))
+			die("Iterating backwards with a cursor does not match btree_fetch");
+	}
+	if (i != 0)
+		die("Iterating backwards with a cursor skipped entries");
+}
+
+/*
+ * Checks that a frozen copy of a btree finds and counts the same entries as the
+ * btree, including when looking up numbers between them
+ */
+static void
+check_frozen(const struct Btree *btree, size_t count)
+{
+	struct Btree_Frozen *frozen = btree_freeze(btree);
+	const uint64_t *previous = NULL;
+	for (size_t i = 0; i < count; i++) {
+		size_t contiguous, index, expected_index;
+		const uint64_t *nr = btree_frozen_fetch(frozen, i, &contiguous);
+		if (*nr != *(const uint64_t *) btree_fetch(btree, i, &contiguous))
+			die("btree_frozen_fetch does not match btree_fetch");
+		if (btree_frozen_find(frozen, nr, &index, &contiguous) != nr || index != i || contiguous != count - i)
+			die("btree_frozen_find does not match btree_frozen_fetch");
+		if (btree_frozen_rank(frozen, nr) != i)
+			die("btree_frozen_rank does not match btree_frozen_fetch");
+		btree_frozen_upper_bound(frozen, nr, &index, &contiguous);
+		if (index != i + 1)
+			die("btree_frozen_upper_bound does not match btree_frozen_fetch");
+		if (previous != NULL && btree_frozen_count_range(frozen, previous, nr) != 1)
+			die("btree_frozen_count_range does not count a single entry");
+
+		uint64_t next = *nr + 1;
+		btree_lower_bound(btree, &next, &expected_index, &contiguous);
+		btree_frozen_lower_bound(frozen, &next, &index, &contiguous);
+		if (index != expected_index)
+			die("btree_frozen_lower_bound does not match btree_lower_bound");
+		previous = nr;
+	}
+	btree_frozen_free(frozen);
+}
+
+/*
+ * Builds a sequence of numbers in a btree in sequence mode by inserting each
+ * number in the middle, so that the odd numbers end up in ascending order
+ * before the even numbers in descending order, and removes them again by index.
+ * Branches keep track of the entry counts of their children as `counts`.
+ */
+static void
+check_sequence(size_t branch_size, size_t leaf_size, size_t count, enum Btree_Counts counts)
+{
+	struct Btree *btree = btree_new_config(&(struct Btree_Config) {
+		.branch_child_count_max = branch_size,
+		.leaf_entry_count_max = leaf_size,
+		.entry_size = sizeof(uint64_t),
+		.counts = counts,
+	});
+	for (uint64_t i = 0; i < count; i++) {
+		if (*(uint64_t *) btree_insert_at(btree, i / 2, &i) != i)
+			die("btree_insert_at did not return the stored entry");
+	}
+	for (size_t i = 0; i < count; i++) {
+		size_t contiguous;
+		uint64_t expected = i < count / 2 ? i * 2 + 1 : (count - 1 - i) * 2;
+		if (*(const uint64_t *) btree_fetch(btree, i, &contiguous) != expected)
+			die("btree_insert_at placed an entry at the wrong index");
+	}
+	for (size_t i = count; i > 0; i--) {
+		uint64_t removed;
+		btree_remove_at(btree, (i - 1) / 2, &removed);
+		if (removed != i - 1)
+			die("btree_remove_at removed the wrong entry from a sequence");
+	}
+	btree_free(btree);
+}
+
+/*
+ * Returns the key of the `i`th entry inserted into a btree with a built-in key
+ * type, spread over the whole range of the type
+ */
+static uint64_t
+get_key(enum Btree_Key_Type key_type, size_t i)
+{
+	uint64_t key = get_number(i) * UINT64_C(0x9e3779b97f4a7c15);
+	return key_type == BTREE_KEY_U32 ? key >> 32 : key;
+}
+
+/*
+ * Returns whether key `a` comes before key `b` for a built-in key type
+ */
+static bool
+key_before(enum Btree_Key_Type key_type, uint64_t a, uint64_t b)
+{
+	return key_type == BTREE_KEY_I64 ? (int64_t) a < (int64_t) b : a < b;
+}
+
+/*
+ * Checks that a btree with a built-in key type orders its entries correctly and
+ * that lookups find each of them
+ */
+static void
+check_key_type(size_t branch_size, size_t leaf_size, size_t count, enum Btree_Key_Type key_type)
+{
+	size_t entry_size = key_type == BTREE_KEY_U32 ? sizeof(uint32_t) : sizeof(uint64_t);
+	struct Btree *btree = btree_new_config(&(struct Btree_Config) {
+		.branch_child_count_max = branch_size,
+		.leaf_entry_count_max = leaf_size,
+		.entry_size = entry_size,
+		.key_type = key_type,
+		.prefetch = true,
+	});
+	size_t entry_count = 0;
+	for (size_t i = 0; i < count; i++) {
+		uint64_t key = get_key(key_type, i);
+		uint32_t key_u32 = key;
+		if (btree_insert(btree, key_type == BTREE_KEY_U32 ? (void *) &key_u32 : (void *) &key, NULL) == BTREE_INSERTED)
+			entry_count++;
+	}
+
+	uint64_t previous = 0;
+	for (size_t i = 0; i < entry_count; i++) {
+		size_t index, contiguous;
+		const void *entry = btree_fetch(btree, i, &contiguous);
+		uint64_t key = key_type == BTREE_KEY_U32 ? *(const uint32_t *) entry : *(const uint64_t *) entry;
+		if (i > 0 && !key_before(key_type, previous, key))
+			die("Entries with a built-in key type are out of order");
+		if (btree_lower_bound(btree, entry, &index, &contiguous) != entry || index != i)
+			die("btree_lower_bound does not match btree_fetch for a built-in key type");
+		btree_upper_bound(btree, entry, &index, &contiguous);
+		if (index != i + 1)
+			die("btree_upper_bound does not match btree_fetch for a built-in key type");
+		previous = key;
+	}
+
+	struct Btree_Frozen *frozen = btree_freeze(btree);
+	for (size_t i = 0; i < entry_count; i++) {
+		size_t index, contiguous;
+		const void *entry = btree_frozen_fetch(frozen, i, &contiguous);
+		if (btree_frozen_find(frozen, entry, &index, &contiguous) != entry || index != i)
+			die("btree_frozen_find does not match btree_frozen_fetch for a built-in key type");
+	}
+	btree_frozen_free(frozen);
+	btree_free(btree);
+}
+
+/*
+ * An allocator that fails once more than a budget of bytes is in use
+ */
+struct Budget {
+	size_t used;
+	size_t limit;
+};
+
+static void *
+budget_alloc(void *context, size_t size, size_t alignment)
+{
+	struct Budget *budget = context;
+	if (size > budget->limit - budget->used)
+		return NULL;
+	budget->used += size;
+	return aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment);
+}
+
+static void
+budget_free(void *context, void *ptr, size_t size)
+{
+	struct Budget *budget = context;
+	budget->used -= size;
+	free(ptr);
+}
+
+/*
+ * Inserts entries into a btree whose allocator runs out of memory, and checks
+ * that the failed insertions leave the btree unchanged and that all of the
+ * memory is given back.  Then freezes the btree, inserts a batch into it and
+ * bulk loads its entries into another btree with the budget running out at
+ * every step of the way, until each of them succeeds.
+ */
+static void
+check_allocator(size_t branch_size, size_t leaf_size, size_t count)
+{
+	struct Budget budget = { 0, 64 * 1024 };
+	struct Btree_Allocator allocator = { budget_alloc, budget_free, &budget, 64 };
+	struct Btree_Config config = {
+		.branch_child_count_max = branch_size,
+		.leaf_entry_count_max = leaf_size,
+		.entry_size = sizeof(uint64_t),
+		.compare = compare,
+		.allocator = &allocator,
+	};
+	struct Btree *btree = btree_new_config(&config);
+	struct Btree *loaded = btree_new_config(&config);
+	if (btree == NULL || loaded == NULL)
+		die("btree_new_config failed with memory to spare");
+
+	size_t entry_count = 0;
+	bool failed = false;
+	for (size_t i = 0; i < count && !failed; i++) {
+		uint64_t nr = get_number(i);
+		const void *stored;
+		enum Btree_Insert_Result result = btree_insert(btree, &nr, &stored);
+		if (result == BTREE_INSERTED)
+			entry_count++;
+		failed = result == BTREE_FAILED;
+		if (failed && stored != NULL)
+			die("btree_insert returned an entry it failed to store");
+	}
+	check(btree, entry_count);
+
+	/* Each step lets the budget grow a little past what is used */
+	const size_t step = 512;
+	struct Btree_Frozen *frozen = NULL;
+	for (size_t extra = 0; frozen == NULL; extra += step) {
+		budget.limit = budget.used + extra;
+		frozen = btree_freeze(btree);
+	}
+	for (size_t i = 0; i < entry_count; i++) {
+		size_t contiguous;
+		if (*(const uint64_t *) btree_frozen_fetch(frozen, i, &contiguous) != *(const uint64_t *) btree_fetch(btree, i, &contiguous))
+			die("btree_freeze made a copy that doesn't match the btree");
+	}
+	btree_frozen_free(frozen);
+
+	size_t batch_count = count / 4 + 1;
+	uint64_t *batch = xmalloc(batch_count * sizeof(uint64_t));
+	for (size_t i = 0; i < batch_count; i++)
+		batch[i] = get_number(count + i);
+	for (size_t extra = 0; ; extra += step) {
+		budget.limit = budget.used + extra;
+		size_t inserted = btree_insert_batch(btree, batch, batch_count);
+		if (inserted != SIZE_MAX) {
+			entry_count += inserted;
+			break;
+		}
+		uint64_t last = UINT64_MAX;
+		if (btree_rank(btree, &last) != entry_count)
+			die("btree_insert_batch changed the btree when its allocator failed");
+	}
+	check(btree, entry_count);
+	free(batch);
+
+	uint64_t *entries = xmalloc(entry_count * sizeof(uint64_t));
+	struct Btree_Cursor cursor;
+	size_t i = 0;
+	for (const uint64_t *nr = btree_cursor_first(&cursor, btree); nr != NULL; nr = btree_cursor_next(&cursor))
+		entries[i++] = *nr;
+	for (size_t extra = 0; !btree_bulk_load(loaded, entries, entry_count, 0.75); extra += step) {
+		check(loaded, 0);
+		budget.limit = budget.used + extra;
+	}
+	check(loaded, entry_count);
+	free(entries);
+
+	btree_free(btree);
+	btree_free(loaded);
+	if (budget.used != 0)
+		die("The allocator of a btree did not get all of its memory back");
+}
+
+/*
+ * Inserts entries into a btree with nodes sized in bytes
+ */
+static void
+check_sized(size_t branch_node_size, size_t leaf_node_size, size_t count)
+{
+	struct Btree *btree = btree_new_sized(branch_node_size, leaf_node_size, sizeof(uint64_t), compare, NULL);
+	size_t entry_count = 0;
+	for (size_t i = 0; i < count; i++) {
+		uint64_t nr = get_number(i);
+		if (btree_insert(btree, &nr, NULL) == BTREE_INSERTED)
+			entry_count++;
+	}
+	check(btree, entry_count);
+	btree_free(btree);
+}
+
+/*
+ * A record much larger than the key it is ordered by
+ */
+struct Record {
+	uint64_t payload[24];
+	uint64_t key;
+};
+
+/*
+ * Inserts records into a btree whose branches only store the keys of the
+ * records, with keys compared by `key_type`, and looks them up by key
+ */
+static void
+check_projection(size_t branch_size, size_t leaf_size, size_t count, enum Btree_Key_Type key_type)
+{
+	struct Btree *btree = btree_new_config(&(struct Btree_Config) {
+		.branch_child_count_max = branch_size,
+		.leaf_entry_count_max = leaf_size,
+		.entry_size = sizeof(struct Record),
+		.key_size = sizeof(uint64_t),
+		.key_offset = offsetof(struct Record, key),
+		.compare = compare,
+		.key_type = key_type,
+	});
+	size_t entry_count = 0;
+	for (size_t i = 0; i < count; i++) {
+		struct Record record = { .key = get_number(i) };
+		record.payload[0] = i;
+		if (btree_insert(btree, &record, NULL) == BTREE_INSERTED)
+			entry_count++;
+	}
+
+	struct Btree_Frozen *frozen = btree_freeze(btree);
+	for (size_t i = 0; i < entry_count; i++) {
+		size_t index, contiguous;
+		const struct Record *record = btree_fetch(btree, i, &contiguous);
+		if (get_number(record->payload[0]) != record->key)
+			die("A record was not stored whole");
+		if (btree_find(btree, &record->key, &index, &contiguous) != record || index != i)
+			die("btree_find does not find a record by its key");
+		const struct Record *frozen_record = btree_frozen_find(frozen, &record->key, &index, &contiguous);
+		if (frozen_record == NULL || frozen_record->key != record->key || index != i)
+			die("btree_frozen_find does not find a record by its key");
+	}
+	btree_frozen_free(frozen);
+
+	for (size_t i = 0; i < count; i += 2) {
+		uint64_t key = get_number(i);
+		struct Record removed;
+		if (btree_remove(btree, &key, &removed)) {
+			if (removed.key != key)
+				die("btree_remove removed the wrong record");
+			entry_count--;
+		}
+	}
+	size_t i = 0;
+	struct Btree_Cursor cursor;
+	const struct Record *previous = NULL;
+	for (const struct Record *record = btree_cursor_first(&cursor, btree); record != NULL; record = btree_cursor_next(&cursor)) {
+		if (previous != NULL && previous->key >= record->key)
+			die("Records are out of order");
+		previous = record;
+		i++;
+	}
+	if (i != entry_count)
+		die("Removing records by key removed the wrong number of them");
+	btree_free(btree);
+}
+
+struct Name {
+	uint64_t id;
+	const char *name;
+};
+
+static int
+compare_names(const void *void_a, const void *void_b, const void *data)
+{
+	(void) data;
+	const char *const *a = void_a;
+	const char *const *b = void_b;
+	return strcmp(*b, *a);
+}
+
+/*
+ * Normalizes a name to its first 8 bytes, read as a big-endian number
+ */
+static uint64_t
+normalize_name(const void *key, const void *data)
+{
+	(void) data;
+	const char *name = *(const char *const *) key;
+	uint64_t normalized = 0;
+	for (size_t i = 0; i < 8 && name[i] != '\0'; i++)
+		normalized |= (uint64_t) (uint8_t) name[i] << (56 - i * 8);
+	return normalized;
+}
+
+/*
+ * Checks that the entries of a btree with string keys are in order, and that
+ * lookups with copies of their keys, and with keys just after them, find them
+ * in the btree and in a frozen copy
+ */
+static void
+check_names(const struct Btree *btree, size_t count)
+{
+	struct Btree_Frozen *frozen = btree_freeze(btree);
+	struct Btree_Cursor cursor;
+	const struct Name *previous = NULL;
+	size_t i = 0;
+	for (const struct Name *entry = btree_cursor_first(&cursor, btree); entry != NULL; entry = btree_cursor_next(&cursor)) {
+		if (previous != NULL && strcmp(previous->name, entry->name) >= 0)
+			die("Entries with string keys are out of order");
+		char copy[80];
+		snprintf(copy, sizeof(copy), "%s", entry->name);
+		const char *key = copy;
+		size_t index, contiguous;
+		if (btree_find(btree, &key, &index, &contiguous) != entry || index != i)
+			die("btree_find does not find an entry by a copy of its string key");
+		const struct Name *frozen_entry = btree_frozen_find(frozen, &key, &index, &contiguous);
+		if (frozen_entry == NULL || frozen_entry->id != entry->id || index != i)
+			die("btree_frozen_find does not find an entry by a copy of its string key");
+
+		/* Nothing but the entry itself comes between it and its key followed by a byte */
+		snprintf(copy, sizeof(copy), "%s\x01", entry->name);
+		btree_lower_bound(btree, &key, &index, &contiguous);
+		if (index != i + 1 || btree_frozen_rank(frozen, &key) != i + 1)
+			die("btree_lower_bound does not place a string key after the entry it extends");
+		previous = entry;
+		i++;
+	}
+	if (i != count)
+		die("A btree with string keys has the wrong number of entries");
+	btree_frozen_free(frozen);
+}
+
+/*
+ * Writes the name of the `i`th entry of a btree with string keys to `names`,
+ * with a prefix shared with many other names, and returns it
+ */
+static const char *
+write_name(char *names, size_t i)
+{
+	static const char prefix[] = "https://example.org/catalog/items/by-name/";
+	uint64_t nr = get_number(i);
+	snprintf(names + i * 64, 64, "%.*s%llu", (int) (nr % sizeof(prefix)), prefix, (unsigned long long) nr);
+	return names + i * 64;
+}
+
+/*
+ * Inserts entries keyed by strings with long shared prefixes, so that most
+ * separators in branches of `separator_size` bytes are cut short, removes half
+ * of them, and puts them back through splits, batches and bulk loads.  Given
+ * a `leaf_node_size`, leaves store copies of the keys, and the original
+ * strings are wiped to check that the btree doesn't read them.  Given a
+ * `normalize` function, the names are compared as custom keys instead, most
+ * of which normalize to the same number.
+ */
+static void
+check_strings(size_t branch_size, size_t leaf_size, size_t count, size_t separator_size, size_t leaf_node_size, Btree_Normalize *normalize)
+{
+	char *names = xmalloc(count * 64);
+	struct Btree_Config config = {
+		.branch_child_count_max = branch_size,
+		.leaf_entry_count_max = leaf_size,
+		.leaf_node_size = leaf_node_size,
+		.entry_size = sizeof(struct Name),
+		.key_size = separator_size,
+		.key_offset = offsetof(struct Name, name),
+		.key_type = normalize != NULL ? BTREE_KEY_CUSTOM : BTREE_KEY_STRING,
+		.compare = compare_names,
+		.normalize = normalize,
+		.inline_keys = leaf_node_size != 0,
+	};
+	struct Btree *btree = btree_new_config(&config);
+	size_t entry_count = 0;
+	for (size_t i = 0; i < count; i++) {
+		struct Name entry = { i, write_name(names, i) };
+		if (btree_insert(btree, &entry, NULL) == BTREE_INSERTED)
+			entry_count++;
+	}
+	if (config.inline_keys)
+		memset(names, 0, count * 64);
+	check_names(btree, entry_count);
+
+	for (size_t i = 0; i < count; i++)
+		write_name(names, i);
+	for (size_t i = 0; i < count; i += 2) {
+		const char *key = names + i * 64;
+		struct Name removed;
+		if (btree_remove(btree, &key, &removed)) {
+			/* With inline keys, the name of the removed entry is already gone */
+			if (strcmp(names + removed.id * 64, key) != 0)
+				die("btree_remove removed the wrong entry with a string key");
+			entry_count--;
+		}
+	}
+	check_names(btree, entry_count);
+
+	struct Btree *upper = btree_split_at(btree, entry_count / 3);
+	check_names(btree, entry_count / 3);
+	check_names(upper, entry_count - entry_count / 3);
+	if (!btree_concat(btree, upper))
+		die("btree_concat did not join the halves of a btree with string keys");
+	btree_free(upper);
+
+	struct Name *entries = xmalloc(count * sizeof(struct Name));
+	size_t removed_count = 0;
+	for (size_t i = 0; i < count; i += 2)
+		entries[removed_count++] = (struct Name) { i, names + i * 64 };
+	entry_count += btree_insert_batch(btree, entries, removed_count);
+	if (config.inline_keys)
+		memset(names, 0, count * 64);
+	check_names(btree, entry_count);
+
+	/* The entries point to the keys in the btree, which the new one copies */
+	struct Btree_Cursor cursor;
+	size_t i = 0;
+	for (const struct Name *entry = btree_cursor_first(&cursor, btree); entry != NULL; entry = btree_cursor_next(&cursor))
+		entries[i++] = *entry;
+	struct Btree *loaded = btree_new_config(&config);
+	if (!btree_bulk_load(loaded, entries, entry_count, 0.75))
+		die("btree_bulk_load rejected sorted entries with string keys");
+	if (config.inline_keys)
+		btree_free(btree);
+	check_names(loaded, entry_count);
+	if (!config.inline_keys)
+		btree_free(btree);
+	btree_free(loaded);
+
+	/* A key too long to store in a leaf is turned away rather than fatal */
+	if (config.inline_keys) {
+		char *long_name = xmalloc(leaf_node_size + 1);
+		memset(long_name, 'a', leaf_node_size);
+		long_name[leaf_node_size] = '\0';
+		struct Name long_entry = { 0, long_name };
+		struct Btree *rejected = btree_new_config(&config);
+		if (btree_bulk_load(rejected, &long_entry, 1, 0.75))
+			die("btree_bulk_load accepted a key too long to store in a leaf");
+		btree_free(rejected);
+		free(long_name);
+	}
+	free(entries);
+	free(names);
+}
+
+/*
+ * An entry with a composite key, ordered by group, then by code in descending
+ * order, then by name
+ */
+struct Listing {
+	const char *name;
+	int32_t group;
+	uint8_t code[4];
+	uint64_t id;
+};
+
+static const struct Btree_Key_Field listing_fields[] = {
+	{ .type = BTREE_FIELD_I32, .offset = offsetof(struct Listing, group) },
+	{ .type = BTREE_FIELD_BYTES, .offset = offsetof(struct Listing, code), .size = 4, .descending = true },
+	{ .type = BTREE_FIELD_STRING, .offset = offsetof(struct Listing, name) },
+};
+
+/*
+ * Returns whether the listing `a` comes before the listing `b`, without the
+ * built-in comparison functions
+ */
+static bool
+listing_precedes(const struct Listing *a, const struct Listing *b)
+{
+	if (a->group != b->group)
+		return a->group < b->group;
+	int comparison = memcmp(a->code, b->code, sizeof(a->code));
+	if (comparison != 0)
+		return comparison > 0;
+	return strcmp(a->name, b->name) < 0;
+}
+
+/*
+ * Inserts entries with composite keys, whose first fields are mostly equal
+ * and normalize to the same numbers, and entries with signed 32-bit keys
+ * compared with a built-in comparison function, and checks their order
+ */
+static void
+check_fields(size_t branch_size, size_t leaf_size, size_t count)
+{
+	char *names = xmalloc(count * 64);
+	const struct Btree_Key_Fields fields = { listing_fields, sizeof(listing_fields) / sizeof(listing_fields[0]) };
+	struct Btree *btree = btree_new(branch_size, leaf_size, sizeof(struct Listing), btree_compare_fields, &fields);
+	size_t entry_count = 0;
+	for (size_t i = 0; i < count; i++) {
+		uint64_t nr = get_number(i);
+		struct Listing listing = { write_name(names, i), (int32_t) (nr % 7) - 3, { 0 }, i };
+		for (size_t j = 0; j < sizeof(listing.code); j++)
+			listing.code[j] = (uint8_t) (nr >> (j * 3));
+		if (btree_insert(btree, &listing, NULL) == BTREE_INSERTED)
+			entry_count++;
+	}
+
+	struct Btree_Cursor cursor;
+	const struct Listing *previous = NULL;
+	size_t i = 0;
+	for (const struct Listing *listing = btree_cursor_first(&cursor, btree); listing != NULL; listing = btree_cursor_next(&cursor)) {
+		if (previous != NULL && !listing_precedes(previous, listing))
+			die("Entries with composite keys are out of order");
+		struct Listing copy = *listing;
+		size_t index, contiguous;
+		if (btree_find(btree, &copy, &index, &contiguous) != listing || index != i)
+			die("btree_find does not find an entry by a copy of its composite key");
+		previous = listing;
+		i++;
+	}
+	if (i != entry_count)
+		die("A btree with composite keys has the wrong number of entries");
+	btree_free(btree);
+	free(names);
+
+	struct Btree *numbers = btree_new(branch_size, leaf_size, sizeof(int32_t), btree_compare_i32, NULL);
+	for (size_t i = 0; i < count; i++) {
+		int32_t nr = (int32_t) (uint32_t) get_number(i);
+		btree_insert(numbers, &nr, NULL);
+	}
+	const int32_t *previous_nr = NULL;
+	for (const int32_t *nr = btree_cursor_first(&cursor, numbers); nr != NULL; nr = btree_cursor_next(&cursor)) {
+		size_t index, contiguous;
+		if ((previous_nr != NULL && *previous_nr >= *nr) || btree_find(numbers, nr, &index, &contiguous) != nr)
+			die("Signed 32-bit keys are out of order");
+		previous_nr = nr;
+	}
+	btree_free(numbers);
+}
+
+int
+main(int argc, char **argv)
+{
+	if (!(4 <= argc && argc <= 5)) {
+		fprintf(stderr, "Invalid argc\n");
+		return EXIT_FAILURE;
+	}
+
+	size_t branch_size = atol(argv[1]);
+	size_t leaf_size = atol(argv[2]);
+	size_t count = atol(argv[3]);
+	if (branch_size < 4 || leaf_size < 2 || !(0 < count && count <= (size_t) 65536 * 65536)) {
+		fprintf(stderr, "Invalid argv\n");
+		return EXIT_FAILURE;
+	}
+
+	struct Btree *btree = btree_new(branch_size, leaf_size, sizeof(uint64_t), compare, NULL);
+	size_t entry_count = 0;
+	for (size_t i = 0; i < count; i++) {
+		uint64_t nr = get_number(i);
+		const void *stored;
+		enum Btree_Insert_Result result = btree_insert(btree, &nr, &stored);
+		if (result == BTREE_INSERTED)
+			entry_count++;
+		else if (result != BTREE_REJECTED)
+			die("btree_insert did not reject a duplicate");
+		if (*(const uint64_t *) stored != nr)
+			die("btree_insert did not return the stored entry");
+	}
+	check(btree, entry_count);
+
+	/* Remove every other number by key */
+	for (size_t i = 0; i < count; i += 2) {
+		uint64_t nr = get_number(i);
+		uint64_t removed;
+		if (btree_remove(btree, &nr, &removed)) {
+			if (removed != nr)
+				die("btree_remove removed the wrong entry");
+			entry_count--;
+		}
+		if (btree_remove(btree, &nr, NULL))
+			die("btree_remove removed an entry twice");
+	}
+	check(btree, entry_count);
+
+	/* Remove entries by index from the middle until a quarter are left */
+	while (entry_count > count / 4) {
+		size_t contiguous;
+		uint64_t nr = *(const uint64_t *) btree_fetch(btree, entry_count / 2, &contiguous);
+		uint64_t removed;
+		btree_remove_at(btree, entry_count / 2, &removed);
+		if (removed != nr)
+			die("btree_remove_at removed the wrong entry");
+		entry_count--;
+	}
+	check(btree, entry_count);
+
+	/* Rebuild the remaining entries into a new btree in one go */
+	uint64_t *entries = xmalloc(entry_count * sizeof(uint64_t));
+	struct Btree_Cursor cursor;
+	size_t i = 0;
+	for (const uint64_t *nr = btree_cursor_first(&cursor, btree); nr != NULL; nr = btree_cursor_next(&cursor))
+		entries[i++] = *nr;
+	btree_free(btree);
+	btree = btree_new(branch_size, leaf_size, sizeof(uint64_t), compare, NULL);
+	if (entry_count > 1 && btree_bulk_load(btree, entries + 1, entry_count - 1, 0.75)) {
+		uint64_t tmp = entries[0];
+		entries[0] = entries[1];
+		entries[1] = tmp;
+		if (btree_bulk_load(btree, entries, entry_count, 0.75))
+			die("btree_bulk_load accepted unsorted entries");
+		entries[1] = entries[0];
+		entries[0] = tmp;
+		if (btree_bulk_load(btree, entries, entry_count, 0.75))
+			die("btree_bulk_load accepted a btree that was not empty");
+		btree_free(btree);
+		btree = btree_new(branch_size, leaf_size, sizeof(uint64_t), compare, NULL);
+	}
+	if (btree_bulk_load(btree, entries, entry_count, 0) || btree_bulk_load(btree, entries, entry_count, 1.5) || btree_bulk_load(btree, entries, entry_count, 0.0 / 0.0))
+		die("btree_bulk_load accepted a fill factor out of range");
+	if (!btree_bulk_load(btree, entries, entry_count, 0.75))
+		die("btree_bulk_load rejected sorted entries");
+	check(btree, entry_count);
+	check_frozen(btree, entry_count);
+
+	/*
+	 * Remove every other entry, and insert them back in batches, in an
+	 * order different from the order they're in in the btree
+	 */
+	size_t removed_count = 0;
+	for (size_t i = entry_count; i > 0; i -= 2) {
+		btree_remove_at(btree, i - 1, &entries[removed_count++]);
+		if (i == 1)
+			break;
+	}
+	check(btree, entry_count - removed_count);
+	size_t inserted = 0;
+	for (size_t i = 0; i < removed_count; i += 1000)
+		inserted += btree_insert_batch(btree, entries + i, removed_count - i < 1000 ? removed_count - i : 1000);
+	if (inserted != removed_count)
+		die("btree_insert_batch did not insert every entry");
+	check(btree, entry_count);
+
+	/* Every entry is already in the btree, so the whole batch is rejected */
+	if (btree_insert_batch(btree, entries, removed_count) != 0)
+		die("btree_insert_batch did not reject duplicates");
+	free(entries);
+	check(btree, entry_count);
+
+	/* Split the btree in two and join the halves back together */
+	struct Btree *upper = btree_split_at(btree, entry_count / 3);
+	check(btree, entry_count / 3);
+	check(upper, entry_count - entry_count / 3);
+	if (entry_count / 3 > 0 && entry_count / 3 < entry_count && btree_concat(upper, btree))
+		die("btree_concat joined overlapping btrees");
+	if (!btree_concat(btree, upper))
+		die("btree_concat did not join the halves of a btree");
+	check(btree, entry_count);
+	check(upper, 0);
+	btree_free(upper);
+
+	check_sequence(branch_size, leaf_size, count, BTREE_COUNTS_CUMULATIVE);
+	check_sequence(branch_size, leaf_size, count, BTREE_COUNTS_PER_CHILD);
+	check_key_type(branch_size, leaf_size, count, BTREE_KEY_U32);
+	check_key_type(branch_size, leaf_size, count, BTREE_KEY_U64);
+	check_key_type(branch_size, leaf_size, count, BTREE_KEY_I64);
+	check_allocator(branch_size, leaf_size, count);
+	check_sized(256, 4096, count);
+	check_sized(128, 192, count);
+	check_projection(branch_size, leaf_size, count, BTREE_KEY_CUSTOM);
+	check_projection(branch_size, leaf_size, count, BTREE_KEY_U64);
+	check_strings(branch_size, leaf_size, count, 0, 0, NULL);
+	check_strings(branch_size, leaf_size, count, 16, 0, NULL);
+	check_strings(branch_size, leaf_size, count, 16, 512, NULL);
+	check_strings(branch_size, leaf_size, count, 0, 4096, NULL);
+	check_strings(branch_size, leaf_size, count, 0, 0, normalize_name);
+	check_fields(branch_size, leaf_size, count);
+
+	if (argc != 5)
+		btree_display(btree, display);
+
+	btree_free(btree);
+}
@@ -0,0 +1,167 @@
+#include <stdio.h>
+#include <stdint.h>
+
+#include "util.h"
+#include "btree.h"
+
+#include "test_data/numbers.h"
+
+#define BTREE_NAME u64_btree
+#define BTREE_ENTRY uint64_t
+#define BTREE_COMPARE(a, b) ((*(b) > *(a)) - (*(b) < *(a)))
+#define BTREE_BRANCH_CHILD_COUNT_MAX 8
+#define BTREE_LEAF_ENTRY_COUNT_MAX 16
+#include "btree_template.h"
+
+struct Pair {
+	uint64_t key;
+	uint64_t value;
+};
+
+#define BTREE_NAME pair_btree
+#define BTREE_ENTRY struct Pair
+#define BTREE_COMPARE(a, b) (((b)->key > (a)->key) - ((b)->key < (a)->key))
+#define BTREE_BRANCH_CHILD_COUNT_MAX 4
+#define BTREE_LEAF_ENTRY_COUNT_MAX 2
+#include "btree_template.h"
+
+static int
+compare(const void *void_a, const void *void_b, const void *data)
+{
+	(void) data;
+	const uint64_t *a = void_a;
+	const uint64_t *b = void_b;
+	return (*b > *a) - (*b < *a);
+}
+
+static uint64_t
+get_number(size_t i)
+{
+	return ((uint64_t) test_numbers[i >> 16] << 16) + test_numbers[i % ((size_t) 1 << 16)];
+}
+
+/*
+ * Checks that a specialized btree holds the same entries as a generic one
+ */
+static void
+check_u64(const struct u64_btree *specialized, const struct Btree *generic)
+{
+	struct Btree_Cursor generic_cursor;
+	struct u64_btree_cursor cursor;
+	const uint64_t *expected = btree_cursor_first(&generic_cursor, generic);
+	const uint64_t *nr = u64_btree_cursor_first(&cursor, specialized);
+	size_t i = 0;
+	for (; expected != NULL; expected = btree_cursor_next(&generic_cursor), nr = u64_btree_cursor_next(&cursor)) {
+		if (nr == NULL || *nr != *expected)
+			die("The specialized btree does not iterate over the same entries as the generic one");
+		size_t index;
+		if (u64_btree_find(specialized, nr, &index) != nr || index != i || u64_btree_fetch(specialized, i) != nr)
+			die("The specialized btree does not find an entry at its index");
+		i++;
+	}
+	if (nr != NULL || u64_btree_count(specialized) != i)
+		die("The specialized btree has more entries than the generic one");
+}
+
+/*
+ * Checks that every node of a specialized btree but the root is at least half
+ * full
+ */
+static void
+check_u64_fill(const struct u64_btree_node *node, bool root)
+{
+	if (node->child_count == 0) {
+		if (!root && node->entry_count < 16 / 2)
+			die("The specialized btree has a leaf less than half full");
+		return;
+	}
+	if (!root && node->child_count < 8 / 2)
+		die("The specialized btree has a branch less than half full");
+	for (size_t i = 0; i < node->child_count; i++)
+		check_u64_fill(u64_btree_as_branch(node)->children[i], false);
+}
+
+/*
+ * Inserts pairs into a specialized btree, which rejects pairs with keys already
+ * in it, and removes them again
+ */
+static void
+check_pairs(size_t count)
+{
+	struct pair_btree *btree = pair_btree_new();
+	for (size_t i = 0; i < count; i++) {
+		struct Pair pair = { get_number(i) % count, i };
+		enum Btree_Insert_Result result = pair_btree_insert(btree, &pair);
+		size_t index;
+		const struct Pair *found = pair_btree_find(btree, &pair, &index);
+		if (found == NULL || (result == BTREE_INSERTED && found->value != i))
+			die("The specialized btree of pairs did not store an entry");
+	}
+	for (size_t i = 0; i < count; i++) {
+		struct Pair pair = { i, 0 };
+		struct Pair removed;
+		bool present = pair_btree_find(btree, &pair, NULL) != NULL;
+		if (pair_btree_remove(btree, &pair, &removed) != present || (present && removed.key != i))
+			die("The specialized btree of pairs did not remove an entry");
+	}
+	if (pair_btree_count(btree) != 0)
+		die("The specialized btree of pairs is not empty");
+	pair_btree_free(btree);
+}
+
+int
+main(int argc, char **argv)
+{
+	if (argc != 2) {
+		fprintf(stderr, "Invalid argc\n");
+		return EXIT_FAILURE;
+	}
+	size_t count = atol(argv[1]);
+	if (!(0 < count && count <= (size_t) 65536 * 65536)) {
+		fprintf(stderr, "Invalid argv\n");
+		return EXIT_FAILURE;
+	}
+
+	struct u64_btree *specialized = u64_btree_new();
+	struct Btree *generic = btree_new(8, 16, sizeof(uint64_t), compare, NULL);
+	for (size_t i = 0; i < count; i++) {
+		uint64_t nr = get_number(i) % (count * 2);
+		if (u64_btree_insert(specialized, &nr) != btree_insert(generic, &nr, NULL))
+			die("The specialized btree does not insert the same entries as the generic one");
+	}
+	check_u64(specialized, generic);
+
+	/* Remove every other number */
+	for (size_t i = 0; i < count; i += 2) {
+		uint64_t nr = get_number(i) % (count * 2);
+		uint64_t removed;
+		if (u64_btree_remove(specialized, &nr, &removed) != btree_remove(generic, &nr, NULL))
+			die("The specialized btree does not remove the same entries as the generic one");
+	}
+	check_u64(specialized, generic);
+
+	/* Numbers inserted in ascending order go through the skewed splits */
+	for (uint64_t nr = count * 2; nr < count * 3; nr++) {
+		u64_btree_insert(specialized, &nr);
+		btree_insert(generic, &nr, NULL);
+	}
+	check_u64(specialized, generic);
+
+	u64_btree_free(specialized);
+	btree_free(generic);
+
+	/*
+	 * Numbers inserted in ascending order in front of a larger one go into
+	 * the last leaf without going at its end, so they split it in half,
+	 * and the branches above it must be split in half too
+	 */
+	specialized = u64_btree_new();
+	uint64_t last = UINT64_MAX;
+	u64_btree_insert(specialized, &last);
+	for (uint64_t nr = 0; nr < count; nr++)
+		u64_btree_insert(specialized, &nr);
+	check_u64_fill(specialized->root, true);
+	u64_btree_free(specialized);
+
+	check_pairs(count);
+}
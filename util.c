@@ -14,6 +14,28 @@ xmalloc(size_t size)
 	return ptr;
 }
 
+void *
+xrealloc(void *ptr, size_t size)
+{
+	ptr = realloc(ptr, size);
+	if (ptr == NULL) {
+		perror("realloc");
+		exit(EXIT_FAILURE);
+	}
+	return ptr;
+}
+
+void *
+xaligned_alloc(size_t alignment, size_t size)
+{
+	void *ptr = aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment);
+	if (ptr == NULL) {
+		perror("aligned_alloc");
+		exit(EXIT_FAILURE);
+	}
+	return ptr;
+}
+
 noreturn void
 die(const char *msg)
 {
@@ -7,6 +7,8 @@
 #define COUNT_OF(x) (sizeof(x) / sizeof((x)[0]))
 
 void *xmalloc(size_t);
+void *xrealloc(void *, size_t);
+void *xaligned_alloc(size_t, size_t);
 noreturn void die(const char *);
 
 #endif